@@ -159,6 +159,85 @@ func (r *VoskRecognizer) FinalResult() string {
 	return C.GoString(C.vosk_recognizer_final_result(r.rec))
 }
 
+// Word is a recognized word with times in seconds.
+type Word struct {
+	ID    int
+	Word  string
+	Start float64
+	End   float64
+	Conf  float32
+}
+
+// Alternative is an entry of the n-best list.
+type Alternative struct {
+	Text       string
+	Confidence float32
+	Words      []Word
+}
+
+// Result is a speech recognition result in the structured form, it carries
+// the same information as the JSON result.
+type Result struct {
+	Text         string
+	Words        []Word
+	Alternatives []Alternative
+	Spk          []float32
+	SpkFrames    int
+}
+
+func convertWords(words *C.VoskWord, numWords C.int) []Word {
+	if numWords == 0 {
+		return nil
+	}
+	cwords := (*[1 << 20]C.VoskWord)(unsafe.Pointer(words))[:numWords:numWords]
+	result := make([]Word, numWords)
+	for i, w := range cwords {
+		result[i] = Word{ID: int(w.id), Word: C.GoString(w.word), Start: float64(w.start),
+			End: float64(w.end), Conf: float32(w.conf)}
+	}
+	return result
+}
+
+func convertResult(res *C.VoskResult) *Result {
+	if res == nil {
+		return nil
+	}
+	result := &Result{Text: C.GoString(res.text), Words: convertWords(res.words, res.num_words),
+		SpkFrames: int(res.spk_frames)}
+	if res.num_alternatives > 0 {
+		calternatives := (*[1 << 20]C.VoskAlternative)(unsafe.Pointer(res.alternatives))[:res.num_alternatives:res.num_alternatives]
+		for _, a := range calternatives {
+			result.Alternatives = append(result.Alternatives, Alternative{Text: C.GoString(a.text),
+				Confidence: float32(a.confidence), Words: convertWords(a.words, a.num_words)})
+		}
+	}
+	if res.spk_dim > 0 {
+		cspk := (*[1 << 20]C.float)(unsafe.Pointer(res.spk))[:res.spk_dim:res.spk_dim]
+		for _, v := range cspk {
+			result.Spk = append(result.Spk, float32(v))
+		}
+	}
+	return result
+}
+
+// ResultStruct returns a speech recognition result without JSON
+// serialization. Returns nil on error.
+func (r *VoskRecognizer) ResultStruct() *Result {
+	return convertResult(C.vosk_recognizer_result_struct(r.rec))
+}
+
+// PartialResultStruct returns a partial speech recognition result without
+// JSON serialization.
+func (r *VoskRecognizer) PartialResultStruct() *Result {
+	return convertResult(C.vosk_recognizer_partial_result_struct(r.rec))
+}
+
+// FinalResultStruct returns a final speech recognition result without JSON
+// serialization.
+func (r *VoskRecognizer) FinalResultStruct() *Result {
+	return convertResult(C.vosk_recognizer_final_result_struct(r.rec))
+}
+
 // Reset resets the recognizer.
 func (r *VoskRecognizer) Reset() {
 	C.vosk_recognizer_reset(r.rec)
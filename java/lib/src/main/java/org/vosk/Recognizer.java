@@ -218,6 +218,38 @@ public class Recognizer extends PointerType implements AutoCloseable {
         return LibVosk.vosk_recognizer_final_result(this.getPointer());
     }
 
+    /**
+     * Returns speech recognition result in the structured form.
+     *
+     * Same as #getResult() but without JSON serialization and parsing.
+     *
+     * @return the result
+     * @throws IOException if the result could not be computed
+     */
+    public Result getResultStruct() throws IOException {
+        return new Result(LibVosk.vosk_recognizer_result_struct(this.getPointer()));
+    }
+
+    /**
+     * Returns partial speech recognition result in the structured form.
+     *
+     * @return the partial result, see #getResultStruct()
+     * @throws IOException if the result could not be computed
+     */
+    public Result getPartialResultStruct() throws IOException {
+        return new Result(LibVosk.vosk_recognizer_partial_result_struct(this.getPointer()));
+    }
+
+    /**
+     * Returns final speech recognition result in the structured form.
+     *
+     * @return the final result, see #getResultStruct()
+     * @throws IOException if the result could not be computed
+     */
+    public Result getFinalResultStruct() throws IOException {
+        return new Result(LibVosk.vosk_recognizer_final_result_struct(this.getPointer()));
+    }
+
     /**
      * Reconfigures recognizer to use grammar.
      *
@@ -0,0 +1,136 @@
+package org.vosk;
+
+import com.sun.jna.Pointer;
+import com.sun.jna.Structure;
+import java.io.IOException;
+
+/**
+ * Speech recognition result in the structured form.
+ *
+ * Carries the same information as the JSON result without JSON parsing,
+ * see #Recognizer.getResultStruct().
+ */
+public class Result {
+
+    /** Recognized word with times in seconds */
+    public static class Word {
+        public final int id;
+        public final String word;
+        public final double start;
+        public final double end;
+        public final float conf;
+
+        Word(NativeWord w) {
+            id = w.id;
+            word = w.word;
+            start = w.start;
+            end = w.end;
+            conf = w.conf;
+        }
+    }
+
+    /** Entry of the n-best list */
+    public static class Alternative {
+        public final String text;
+        public final float confidence;
+        public final Word[] words;
+
+        Alternative(NativeAlternative a) {
+            text = a.text;
+            confidence = a.confidence;
+            words = toWords(a.words, a.num_words);
+        }
+    }
+
+    public final String text;
+    public final Word[] words;
+    public final Alternative[] alternatives;
+    public final float[] spk;
+    public final int spkFrames;
+
+    Result(Pointer p) throws IOException {
+        if (p == null) {
+            throw new IOException("Failed to get result");
+        }
+        NativeResult r = new NativeResult(p);
+        text = r.text;
+        words = toWords(r.words, r.num_words);
+        alternatives = new Alternative[r.num_alternatives];
+        if (r.num_alternatives > 0) {
+            Structure[] a = new NativeAlternative(r.alternatives).toArray(r.num_alternatives);
+            for (int i = 0; i < a.length; i++) {
+                alternatives[i] = new Alternative((NativeAlternative) a[i]);
+            }
+        }
+        spk = r.spk_dim > 0 ? r.spk.getFloatArray(0, r.spk_dim) : new float[0];
+        spkFrames = r.spk_frames;
+    }
+
+    private static Word[] toWords(Pointer p, int n) {
+        Word[] words = new Word[n];
+        if (n > 0) {
+            Structure[] w = new NativeWord(p).toArray(n);
+            for (int i = 0; i < n; i++) {
+                words[i] = new Word((NativeWord) w[i]);
+            }
+        }
+        return words;
+    }
+
+    /** Mirrors VoskWord from vosk_api.h */
+    @Structure.FieldOrder({"id", "word", "start", "end", "conf"})
+    public static class NativeWord extends Structure {
+        public int id;
+        public String word;
+        public double start;
+        public double end;
+        public float conf;
+
+        public NativeWord() {
+        }
+
+        public NativeWord(Pointer p) {
+            super(p);
+            read();
+        }
+    }
+
+    /** Mirrors VoskAlternative from vosk_api.h */
+    @Structure.FieldOrder({"text", "confidence", "num_words", "words"})
+    public static class NativeAlternative extends Structure {
+        public String text;
+        public float confidence;
+        public int num_words;
+        public Pointer words;
+
+        public NativeAlternative() {
+        }
+
+        public NativeAlternative(Pointer p) {
+            super(p);
+            read();
+        }
+    }
+
+    /** Mirrors VoskResult from vosk_api.h */
+    @Structure.FieldOrder({"text", "num_words", "words", "num_alternatives", "alternatives",
+                           "spk_dim", "spk", "spk_frames"})
+    public static class NativeResult extends Structure {
+        public String text;
+        public int num_words;
+        public Pointer words;
+        public int num_alternatives;
+        public Pointer alternatives;
+        public int spk_dim;
+        public Pointer spk;
+        public int spk_frames;
+
+        public NativeResult() {
+        }
+
+        public NativeResult(Pointer p) {
+            super(p);
+            read();
+        }
+    }
+}
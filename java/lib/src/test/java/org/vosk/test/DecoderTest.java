@@ -15,6 +15,7 @@ import javax.sound.sampled.UnsupportedAudioFileException;
 
 import org.vosk.LogLevel;
 import org.vosk.Recognizer;
+import org.vosk.Result;
 import org.vosk.Recognizer.EndpointerMode;
 import org.vosk.LibVosk;
 import org.vosk.Model;
@@ -74,6 +75,38 @@ public class DecoderTest {
         Assert.assertTrue(true);
     }
 
+    @Test
+    public void decoderTestStruct() throws IOException, UnsupportedAudioFileException {
+        LibVosk.setLogLevel(LogLevel.DEBUG);
+
+        try (Model model = new Model("model");
+            InputStream ais = AudioSystem.getAudioInputStream(new BufferedInputStream(new FileInputStream("../../python/example/test.wav")));
+            Recognizer recognizer = new Recognizer(model, 16000)) {
+
+            recognizer.setMaxAlternatives(3);
+            recognizer.setPartialWords(true);
+
+            int nbytes;
+            byte[] b = new byte[4096];
+            while ((nbytes = ais.read(b)) >= 0) {
+                if (recognizer.acceptWaveForm(b, nbytes)) {
+                    Result result = recognizer.getResultStruct();
+                    Assert.assertTrue(result.alternatives.length > 0);
+                    Assert.assertEquals(result.alternatives[0].text, result.text);
+                } else {
+                    Result partial = recognizer.getPartialResultStruct();
+                    Assert.assertEquals(0, partial.alternatives.length);
+                }
+            }
+
+            Result result = recognizer.getFinalResultStruct();
+            System.out.println(result.text);
+            for (Result.Word word : result.words) {
+                System.out.println(word.word + " " + word.start + " " + word.end);
+            }
+        }
+    }
+
     @Test
     public void decoderTestGrammar() throws IOException, UnsupportedAudioFileException {
         LibVosk.setLogLevel(LogLevel.DEBUG);
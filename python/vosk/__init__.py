@@ -4,6 +4,7 @@ import srt
 import datetime
 import json
 import enum
+from collections import namedtuple
 
 import requests
 from urllib.request import urlretrieve
@@ -64,6 +65,9 @@ class Model:
     def vosk_model_find_word(self, word):
         return _c.vosk_model_find_word(self._handle, word.encode("utf-8"))
 
+    def warmup(self, seconds=5.0, n_threads=1):
+        return _c.vosk_model_warmup(self._handle, seconds, n_threads)
+
     def get_model_path(self, model_name, lang):
         if model_name is None:
             model_path = self.get_model_by_lang(lang)
@@ -142,6 +146,33 @@ class SpkModel:
     def __del__(self):
         _c.vosk_spk_model_free(self._handle)
 
+    def SetBatching(self, max_batch, max_wait):
+        _c.vosk_spk_model_set_batching(self._handle, max_batch, max_wait)
+
+    def SetCache(self, cache_path):
+        return _c.vosk_spk_model_set_cache(self._handle, cache_path.encode("utf-8"))
+
+# Structured results, see VoskResult in vosk_api.h
+Word = namedtuple("Word", ["id", "word", "start", "end", "conf"])
+Alternative = namedtuple("Alternative", ["text", "confidence", "words"])
+Result = namedtuple("Result", ["text", "words", "alternatives", "spk", "spk_frames"])
+
+def _words_from_struct(words, num_words):
+    return [Word(w.id, _ffi.string(w.word).decode("utf-8"), w.start, w.end, w.conf)
+            for w in (words[i] for i in range(num_words))]
+
+def _result_from_struct(res):
+    if res == _ffi.NULL:
+        raise Exception("Failed to get result")
+    alternatives = [Alternative(_ffi.string(a.text).decode("utf-8"), a.confidence,
+                                _words_from_struct(a.words, a.num_words))
+                    for a in (res.alternatives[i] for i in range(res.num_alternatives))]
+    return Result(_ffi.string(res.text).decode("utf-8"),
+                  _words_from_struct(res.words, res.num_words),
+                  alternatives,
+                  [res.spk[i] for i in range(res.spk_dim)],
+                  res.spk_frames)
+
 class EndpointerMode(enum.Enum):
     DEFAULT = 0
     SHORT = 1
@@ -186,9 +217,27 @@ class KaldiRecognizer:
     def SetEndpointerDelays(self, t_start_max, t_end, t_max):
         _c.vosk_recognizer_set_endpointer_delays(self._handle, t_start_max, t_end, t_max)
 
+    def SetDecodeStep(self, step):
+        _c.vosk_recognizer_set_decode_step(self._handle, step)
+
+    def SetLatencyTarget(self, latency):
+        _c.vosk_recognizer_set_latency_target(self._handle, latency)
+
+    def SetPipelined(self, enable_pipelined):
+        _c.vosk_recognizer_set_pipelined(self._handle, 1 if enable_pipelined else 0)
+
+    def GetRtf(self):
+        return _c.vosk_recognizer_get_rtf(self._handle)
+
     def SetSpkModel(self, spk_model):
         _c.vosk_recognizer_set_spk_model(self._handle, spk_model._handle)
 
+    def SetSpkIncremental(self, enable_incremental):
+        _c.vosk_recognizer_set_spk_incremental(self._handle, 1 if enable_incremental else 0)
+
+    def SetPartialSpk(self, enable_partial_spk):
+        _c.vosk_recognizer_set_partial_spk(self._handle, 1 if enable_partial_spk else 0)
+
     def SetGrammar(self, grammar):
         _c.vosk_recognizer_set_grm(self._handle, grammar.encode("utf-8"))
 
@@ -207,6 +256,15 @@ class KaldiRecognizer:
     def FinalResult(self):
         return _ffi.string(_c.vosk_recognizer_final_result(self._handle)).decode("utf-8")
 
+    def ResultStruct(self):
+        return _result_from_struct(_c.vosk_recognizer_result_struct(self._handle))
+
+    def PartialResultStruct(self):
+        return _result_from_struct(_c.vosk_recognizer_partial_result_struct(self._handle))
+
+    def FinalResultStruct(self):
+        return _result_from_struct(_c.vosk_recognizer_final_result_struct(self._handle))
+
     def Reset(self):
         return _c.vosk_recognizer_reset(self._handle)
 
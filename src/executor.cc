@@ -0,0 +1,131 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "executor.h"
+
+#include "base/kaldi-common.h"
+
+static std::atomic<int> num_helper_threads(0);
+
+void HelperThreadStarted()
+{
+    num_helper_threads++;
+}
+
+void HelperThreadStopped()
+{
+    num_helper_threads--;
+}
+
+int NumHelperThreads()
+{
+    return num_helper_threads;
+}
+
+Executor::Executor(int num_threads)
+{
+    for (int i = 0; i < num_threads; i++) {
+        HelperThreadStarted();
+        threads_.emplace_back(&Executor::Run, this);
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+        HelperThreadStopped();
+    }
+}
+
+void Executor::Submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void Executor::Run()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+            if (tasks_.empty())
+                return;
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+Strand::Strand(Executor *executor) : executor_(executor)
+{
+}
+
+Strand::~Strand()
+{
+    Wait();
+}
+
+void Strand::Post(std::function<void()> task)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    if (!running_) {
+        running_ = true;
+        executor_->Submit([this]() { RunNext(); });
+    }
+}
+
+void Strand::RunNext()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+    }
+
+    try {
+        task();
+    } catch (const std::exception &e) {
+        KALDI_WARN << "Asynchronous task failed: " << e.what();
+    } catch (...) {
+        KALDI_WARN << "Asynchronous task failed";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tasks_.empty()) {
+        running_ = false;
+        cv_.notify_all();
+    } else {
+        executor_->Submit([this]() { RunNext(); });
+    }
+}
+
+void Strand::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !running_; });
+}
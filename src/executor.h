@@ -0,0 +1,78 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_EXECUTOR_H
+#define VOSK_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Count of helper threads running in this process: executor threads,
+// pipelined recognizer workers, background model loading and parallel
+// load or warm-up threads. Speaker batchers count as one each while they
+// exist, a batch is completed by whichever caller thread runs it.
+// Threads are not copied by fork(), so a model can't be preloaded for
+// forked workers while any exist.
+void HelperThreadStarted();
+void HelperThreadStopped();
+int NumHelperThreads();
+
+// Fixed pool of worker threads shared by all recognizers of a model
+class Executor {
+
+public:
+    Executor(int num_threads);
+    ~Executor();
+
+    void Submit(std::function<void()> task);
+
+private:
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()> > tasks_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+};
+
+// Runs tasks one after another in the order they were posted, on any
+// executor thread. Each strand takes one task per turn so that busy
+// strands don't starve the others.
+class Strand {
+
+public:
+    Strand(Executor *executor);
+    ~Strand();
+
+    void Post(std::function<void()> task);
+    // Waits until all posted tasks are done
+    void Wait();
+
+private:
+    void RunNext();
+
+    Executor *executor_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()> > tasks_;
+    bool running_ = false;
+};
+
+#endif /* VOSK_EXECUTOR_H */
@@ -0,0 +1,112 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "json_writer.h"
+
+#include <cstdio>
+
+void JsonWriter::Clear()
+{
+    buffer_.clear();
+    levels_.clear();
+}
+
+// Separates array elements, object members are separated in Key()
+void JsonWriter::StartValue()
+{
+    if (levels_.empty() || levels_.back().object)
+        return;
+    if (!levels_.back().empty)
+        buffer_ += ", ";
+    levels_.back().empty = false;
+}
+
+void JsonWriter::StartObject()
+{
+    StartValue();
+    buffer_ += "{\n";
+    levels_.push_back(Level{true, true});
+}
+
+void JsonWriter::EndObject()
+{
+    buffer_ += '\n';
+    buffer_.append(2 * (levels_.size() - 1), ' ');
+    buffer_ += '}';
+    levels_.pop_back();
+}
+
+void JsonWriter::StartArray()
+{
+    StartValue();
+    buffer_ += '[';
+    levels_.push_back(Level{false, true});
+}
+
+void JsonWriter::EndArray()
+{
+    buffer_ += ']';
+    levels_.pop_back();
+}
+
+void JsonWriter::Key(const char *key)
+{
+    if (!levels_.back().empty)
+        buffer_ += ",\n";
+    levels_.back().empty = false;
+    buffer_.append(2 * levels_.size(), ' ');
+    buffer_ += '"';
+    buffer_ += key;
+    buffer_ += "\" : ";
+}
+
+void JsonWriter::String(const string &value)
+{
+    StartValue();
+    buffer_ += '"';
+    for (char c : value) {
+        switch (c) {
+            case '\"': buffer_ += "\\\""; break;
+            case '\\': buffer_ += "\\\\"; break;
+            case '\b': buffer_ += "\\b";  break;
+            case '\f': buffer_ += "\\f";  break;
+            case '\n': buffer_ += "\\n";  break;
+            case '\r': buffer_ += "\\r";  break;
+            case '\t': buffer_ += "\\t";  break;
+            default  : buffer_ += c;      break;
+        }
+    }
+    buffer_ += '"';
+}
+
+// Same formats std::to_string uses, without the temporary string
+void JsonWriter::Float(double value)
+{
+    StartValue();
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%f", value);
+    if (len < (int)sizeof(buf)) {
+        buffer_.append(buf, len);
+    } else {
+        buffer_ += std::to_string(value);
+    }
+}
+
+void JsonWriter::Int(long value)
+{
+    StartValue();
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%ld", value);
+    buffer_.append(buf, len);
+}
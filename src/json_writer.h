@@ -0,0 +1,56 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_JSON_WRITER_H
+#define VOSK_JSON_WRITER_H
+
+#include <string>
+#include <vector>
+
+using std::string;
+
+// Append-only JSON writer for results. Produces exactly the same text as
+// json::JSON::dump(), so keys must be written in sorted order, that is how
+// json::JSON stores them. The buffer keeps its capacity between results,
+// so writing a result doesn't allocate in the steady state.
+class JsonWriter {
+
+public:
+    void Clear();
+
+    void StartObject();
+    void EndObject();
+    void StartArray();
+    void EndArray();
+
+    void Key(const char *key);
+    void String(const string &value);
+    void Float(double value);
+    void Int(long value);
+
+    string &Buffer() { return buffer_; }
+
+private:
+    void StartValue();
+
+    struct Level {
+        bool object;
+        bool empty;
+    };
+
+    string buffer_;
+    std::vector<Level> levels_;
+};
+
+#endif /* VOSK_JSON_WRITER_H */
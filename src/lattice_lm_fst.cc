@@ -0,0 +1,140 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lattice_lm_fst.h"
+
+LatticeLmCache::LatticeLmCache(const fst::StdVectorFst &lm, int64 max_bytes)
+    : lm_(lm), max_bytes_(max_bytes)
+{
+    // The state table is part of the cache memory
+    int64 table_bytes = static_cast<int64>(lm_.NumStates()) * sizeof(std::atomic<const vector<LatticeArc> *>);
+    if (table_bytes >= max_bytes_) {
+        KALDI_WARN << "Rescoring LM with " << lm_.NumStates() << " states doesn't fit into "
+                   << (max_bytes_ >> 20) << " MB of lm-cache-mb, states are converted for each composition";
+        full_ = true;
+        return;
+    }
+
+    states_.reset(new std::atomic<const vector<LatticeArc> *>[lm_.NumStates()]);
+    for (int32 s = 0; s < lm_.NumStates(); s++) {
+        states_[s] = nullptr;
+    }
+    bytes_ = table_bytes;
+}
+
+LatticeLmCache::~LatticeLmCache()
+{
+    if (!states_)
+        return;
+    for (int32 s = 0; s < lm_.NumStates(); s++) {
+        delete states_[s].load();
+    }
+}
+
+void ConvertLmArcs(const fst::StdVectorFst &lm, int32 state, vector<LatticeArc> *arcs)
+{
+    arcs->clear();
+    arcs->reserve(lm.NumArcs(state));
+    for (fst::ArcIterator<fst::StdVectorFst> aiter(lm, state); !aiter.Done(); aiter.Next()) {
+        const fst::StdArc &arc = aiter.Value();
+        arcs->push_back(LatticeArc(arc.ilabel, arc.olabel,
+                                   LatticeWeight(arc.weight.Value(), 0.0),
+                                   arc.nextstate));
+    }
+}
+
+void LatticeLmCache::AddCounts(int64 hits, int64 misses)
+{
+    hits_.fetch_add(hits, std::memory_order_relaxed);
+    misses_.fetch_add(misses, std::memory_order_relaxed);
+}
+
+const vector<LatticeArc> *LatticeLmCache::Arcs(int32 state, bool *hit)
+{
+    *hit = false;
+    if (!states_)
+        return nullptr;
+
+    const vector<LatticeArc> *arcs = states_[state].load(std::memory_order_acquire);
+    *hit = (arcs != nullptr);
+    if (arcs) {
+        return arcs;
+    }
+
+    // Once the cache is full misses don't touch the shared size
+    if (full_.load(std::memory_order_relaxed))
+        return nullptr;
+
+    int64 size = sizeof(vector<LatticeArc>) + lm_.NumArcs(state) * sizeof(LatticeArc);
+    if (bytes_.fetch_add(size, std::memory_order_relaxed) + size > max_bytes_) {
+        bytes_.fetch_sub(size, std::memory_order_relaxed);
+        full_.store(true, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    vector<LatticeArc> *new_arcs = new vector<LatticeArc>();
+    ConvertLmArcs(lm_, state, new_arcs);
+
+    // Another thread could convert the same state meanwhile, keep the first one
+    const vector<LatticeArc> *expected = nullptr;
+    if (!states_[state].compare_exchange_strong(expected, new_arcs, std::memory_order_acq_rel)) {
+        delete new_arcs;
+        bytes_.fetch_sub(size, std::memory_order_relaxed);
+        return expected;
+    }
+    return new_arcs;
+}
+
+LatticeLmFst::Weight LatticeLmFst::Final(StateId s) const
+{
+    fst::StdArc::Weight final = lm_.Final(s);
+    if (final == fst::StdArc::Weight::Zero())
+        return Weight::Zero();
+    return Weight(final.Value(), 0.0);
+}
+
+const string &LatticeLmFst::Type() const
+{
+    static const string type = "lattice-lm";
+    return type;
+}
+
+void LatticeLmFst::InitStateIterator(fst::StateIteratorData<LatticeArc> *data) const
+{
+    data->base = nullptr;
+    data->nstates = lm_.NumStates();
+}
+
+void LatticeLmFst::InitArcIterator(StateId s, fst::ArcIteratorData<LatticeArc> *data) const
+{
+    bool hit;
+    const vector<LatticeArc> *arcs = cache_->Arcs(s, &hit);
+    if (hit) {
+        hits_++;
+    } else {
+        misses_++;
+    }
+    if (!arcs) {
+        auto it = local_.find(s);
+        if (it == local_.end()) {
+            it = local_.emplace(s, vector<LatticeArc>()).first;
+            ConvertLmArcs(lm_, s, &it->second);
+        }
+        arcs = &it->second;
+    }
+    data->base = nullptr;
+    data->arcs = arcs->data();
+    data->narcs = arcs->size();
+    data->ref_count = nullptr;
+}
@@ -0,0 +1,111 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_LATTICE_LM_FST_H
+#define VOSK_LATTICE_LM_FST_H
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-lib.h"
+#include "lat/kaldi-lattice.h"
+
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+using namespace kaldi;
+using namespace std;
+
+// Language model graph converted to lattice arcs for subtraction of the
+// graph LM score during rescoring. Converted states are shared by all
+// recognizers of the model. Reads don't take locks, a state is converted
+// once and published with an atomic pointer. Once the memory limit is
+// reached, new states are converted per composition and not kept. If the
+// state table alone exceeds the limit nothing is cached.
+class LatticeLmCache {
+
+public:
+    LatticeLmCache(const fst::StdVectorFst &lm, int64 max_bytes);
+    ~LatticeLmCache();
+
+    const fst::StdVectorFst &Lm() const { return lm_; }
+
+    // Returns shared arcs of the state or nullptr if the state
+    // doesn't fit into the cache and must be converted by the caller.
+    // Sets hit if the state was already converted.
+    const vector<LatticeArc> *Arcs(int32 state, bool *hit);
+
+    // Lookups are counted by each user and added once it is done, so
+    // concurrent compositions don't contend on the counters
+    void AddCounts(int64 hits, int64 misses);
+
+    int64 Hits() const { return hits_.load(std::memory_order_relaxed); }
+    int64 Misses() const { return misses_.load(std::memory_order_relaxed); }
+    int64 Bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+private:
+    const fst::StdVectorFst &lm_;
+    int64 max_bytes_;
+    unique_ptr<std::atomic<const vector<LatticeArc> *>[]> states_;
+
+    std::atomic<int64> hits_{0};
+    std::atomic<int64> misses_{0};
+    std::atomic<int64> bytes_{0};
+    std::atomic<bool> full_{false};
+};
+
+// Converts LM arcs the same way fst::StdToLatticeMapper does
+void ConvertLmArcs(const fst::StdVectorFst &lm, int32 state, vector<LatticeArc> *arcs);
+
+// Lattice view of the language model over the shared cache, replaces
+// ArcMapFst with StdToLatticeMapper. One instance is used by a single thread
+// at a time, copies made by composition share the cache.
+class LatticeLmFst : public fst::Fst<LatticeArc> {
+
+public:
+    typedef LatticeArc::StateId StateId;
+    typedef LatticeArc::Weight Weight;
+
+    LatticeLmFst(LatticeLmCache *cache) : cache_(cache), lm_(cache->Lm()) {}
+    ~LatticeLmFst() override { cache_->AddCounts(hits_, misses_); }
+
+    StateId Start() const override { return lm_.Start(); }
+    Weight Final(StateId s) const override;
+    size_t NumArcs(StateId s) const override { return lm_.NumArcs(s); }
+    size_t NumInputEpsilons(StateId s) const override { return lm_.NumInputEpsilons(s); }
+    size_t NumOutputEpsilons(StateId s) const override { return lm_.NumOutputEpsilons(s); }
+
+    // Conversion keeps the properties, see fst::StdToLatticeMapper
+    uint64 Properties(uint64 mask, bool test) const override { return lm_.Properties(mask, false); }
+    const string &Type() const override;
+    LatticeLmFst *Copy(bool safe = false) const override { return new LatticeLmFst(cache_); }
+
+    const fst::SymbolTable *InputSymbols() const override { return lm_.InputSymbols(); }
+    const fst::SymbolTable *OutputSymbols() const override { return lm_.OutputSymbols(); }
+
+    void InitStateIterator(fst::StateIteratorData<LatticeArc> *data) const override;
+    void InitArcIterator(StateId s, fst::ArcIteratorData<LatticeArc> *data) const override;
+
+private:
+    LatticeLmCache *cache_;
+    const fst::StdVectorFst &lm_;
+
+    // States which didn't fit into the shared cache, live as long as
+    // this copy, that is one composition
+    mutable unordered_map<StateId, vector<LatticeArc> > local_;
+
+    mutable int64 hits_ = 0;
+    mutable int64 misses_ = 0;
+};
+
+#endif /* VOSK_LATTICE_LM_FST_H */
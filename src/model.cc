@@ -17,8 +17,17 @@
 // For details of possible model layout see doc/models.md section model-structure
 
 #include "model.h"
+#include "recognizer.h"
+#include "base/timer.h"
+#include "json.h"
 
 #include <sys/stat.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <fst/fst.h>
 #include <fst/register.h>
 #include <fst/matcher-fst.h>
@@ -118,14 +127,19 @@ Model::Model(const char *model_path) : model_path_str_(model_path) {
 #endif
 
     struct stat buffer;
+    if (stat(model_path_str_.c_str(), &buffer) == 0 && S_ISREG(buffer.st_mode)) {
+        KALDI_LOG << "Loading model from bundle " << model_path_str_;
+        bundle_ = new ModelBundle(model_path_str_);
+    }
+
     string am_v2_path = model_path_str_ + "/am/final.mdl";
     string model_conf_v2_path = model_path_str_ + "/conf/model.conf";
     string am_v1_path = model_path_str_ + "/final.mdl";
     string mfcc_v1_path = model_path_str_ + "/mfcc.conf";
-    if (stat(am_v2_path.c_str(), &buffer) == 0 && stat(model_conf_v2_path.c_str(), &buffer) == 0) {
+    if (FileExists(am_v2_path) && FileExists(model_conf_v2_path)) {
         ConfigureV2();
         ReadDataFiles();
-    } else if (stat(am_v1_path.c_str(), &buffer) == 0 && stat(mfcc_v1_path.c_str(), &buffer) == 0) {
+    } else if (FileExists(am_v1_path) && FileExists(mfcc_v1_path)) {
         ConfigureV1();
         ReadDataFiles();
     } else {
@@ -161,6 +175,7 @@ void Model::ConfigureV1()
     nnet3_decoding_config_.Register(&po);
     endpoint_config_.Register(&po);
     decodable_opts_.Register(&po);
+    model_opts_.Register(&po);
 
     vector<const char*> args;
     args.push_back("vosk");
@@ -193,7 +208,8 @@ void Model::ConfigureV2()
     nnet3_decoding_config_.Register(&po);
     endpoint_config_.Register(&po);
     decodable_opts_.Register(&po);
-    po.ReadConfigFile(model_path_str_ + "/conf/model.conf");
+    model_opts_.Register(&po);
+    ReadConfig(model_path_str_ + "/conf/model.conf", &po);
 
 
     nnet3_rxfilename_ = model_path_str_ + "/am/final.mdl";
@@ -216,22 +232,164 @@ void Model::ConfigureV2()
     rnnlm_lm_rxfilename_ = model_path_str_ + "/rnnlm/final.raw";
 }
 
-void Model::ReadDataFiles()
+bool Model::FileExists(const string &filename)
 {
+    if (bundle_)
+        return bundle_->Contains(filename);
+
     struct stat buffer;
+    return stat(filename.c_str(), &buffer) == 0;
+}
+
+// Binary Kaldi objects inside the bundle are addressed with the offset
+// rxfilename notation, "bundle:offset", so they can be passed to Kaldi
+// code which opens files by itself.
+string Model::Rxfilename(const string &filename)
+{
+    if (!bundle_)
+        return filename;
+
+    uint64 offset, size;
+    bundle_->Locate(filename, &offset, &size);
+    return bundle_->Path() + ":" + std::to_string(offset);
+}
+
+// Aligned const graphs written by vosk_align_graph are mapped into memory
+// instead of being parsed. Pages are loaded on first access and shared through
+// the page cache between all processes using the same graph file. Other graph
+// types are read as before.
+fst::Fst<fst::StdArc> *Model::ReadFst(const string &filename)
+{
+    string source = filename;
+    uint64 offset = 0, size;
+    if (bundle_) {
+        source = bundle_->Path();
+        bundle_->Locate(filename, &offset, &size);
+    }
+
+    std::ifstream is(source, std::ios_base::in | std::ios_base::binary);
+    is.seekg(offset);
+    fst::FstHeader hdr;
+    if (!is || !hdr.Read(is, filename, true)) {
+        KALDI_ERR << "Could not read fst header from " << filename;
+    }
+
+    fst::FstReadOptions ropts(source);
+    if (model_opts_.mmap_graph && hdr.FstType() == "const" &&
+        (hdr.GetFlags() & fst::FstHeader::IS_ALIGNED)) {
+        KALDI_LOG << "Mapping aligned graph " << filename;
+        ropts.mode = fst::FstReadOptions::MAP;
+    }
+    fst::Fst<fst::StdArc> *fst = fst::Fst<fst::StdArc>::Read(is, ropts);
+    if (!fst) {
+        KALDI_ERR << "Could not read fst from " << filename;
+    }
+    return fst;
+}
+
+// Same as ParseOptions::ReadConfigFile but works with bundle entries too
+void Model::ReadConfig(const string &filename, ParseOptions *po)
+{
+    if (!bundle_) {
+        po->ReadConfigFile(filename);
+        return;
+    }
+
+    ModelInput ki(bundle_, filename);
+    vector<string> lines;
+    string line;
+    while (std::getline(ki.Stream(), line)) {
+        size_t pos = line.find('#');
+        if (pos != string::npos)
+            line.erase(pos);
+        Trim(&line);
+        if (line.empty())
+            continue;
+        if (line.compare(0, 2, "--") != 0) {
+            KALDI_ERR << "Reading config file " << filename
+                      << ": line does not look like an option: " << line;
+        }
+        lines.push_back(line);
+    }
+
+    vector<const char*> args;
+    args.push_back("vosk");
+    args.push_back("--print-args=false");
+    for (const string &l : lines)
+        args.push_back(l.c_str());
+    po->Read(args.size(), args.data());
+}
+
+template<class C>
+void Model::ReadConfig(const string &filename, C *c)
+{
+    ParseOptions po("");
+    c->Register(&po);
+    ReadConfig(filename, &po);
+}
+
+template<class C>
+void Model::ReadObject(const string &filename, C *c)
+{
+    bool binary;
+    ModelInput ki(bundle_, filename, &binary);
+    c->Read(ki.Stream(), binary);
+}
+
+// Runs independent load tasks on up to num_threads threads and records the
+// time of every task. The first error is rethrown once all threads finished.
+void Model::RunLoadTasks(const vector<LoadTask> &tasks, int32 num_threads)
+{
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < tasks.size(); i = next++) {
+            try {
+                Timer timer;
+                tasks[i].second();
+                KALDI_LOG << "Loaded " << tasks[i].first << " in "
+                          << timer.Elapsed() << " seconds";
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                stats_[tasks[i].first].load_ms = timer.Elapsed() * 1000;
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+    };
+
+    vector<std::thread> threads;
+    for (int32 i = 1; i < num_threads && i < (int32)tasks.size(); i++) {
+        HelperThreadStarted();
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+        HelperThreadStopped();
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
 
+void Model::ReadDataFiles()
+{
     KALDI_LOG << "Decoding params beam=" << nnet3_decoding_config_.beam <<
          " max-active=" << nnet3_decoding_config_.max_active <<
          " lattice-beam=" << nnet3_decoding_config_.lattice_beam;
     KALDI_LOG << "Silence phones " << endpoint_config_.silence_phones;
 
-    if (stat(mfcc_conf_rxfilename_.c_str(), &buffer) == 0) {
+    if (FileExists(mfcc_conf_rxfilename_)) {
         feature_info_.feature_type = "mfcc";
-        ReadConfigFromFile(mfcc_conf_rxfilename_, &feature_info_.mfcc_opts);
+        ReadConfig(mfcc_conf_rxfilename_, &feature_info_.mfcc_opts);
         feature_info_.mfcc_opts.frame_opts.allow_downsample = true; // It is safe to downsample
-    } else if (stat(fbank_conf_rxfilename_.c_str(), &buffer) == 0) {
+    } else if (FileExists(fbank_conf_rxfilename_)) {
         feature_info_.feature_type = "fbank";
-        ReadConfigFromFile(fbank_conf_rxfilename_, &feature_info_.fbank_opts);
+        ReadConfig(fbank_conf_rxfilename_, &feature_info_.fbank_opts);
         feature_info_.fbank_opts.frame_opts.allow_downsample = true; // It is safe to downsample
     } else {
         KALDI_ERR << "Failed to find feature config file";
@@ -240,62 +398,168 @@ void Model::ReadDataFiles()
     feature_info_.silence_weighting_config.silence_weight = 1e-3;
     feature_info_.silence_weighting_config.silence_phones_str = endpoint_config_.silence_phones;
 
+    if (FileExists(global_cmvn_stats_rxfilename_)) {
+        KALDI_LOG << "Reading CMVN stats from " << global_cmvn_stats_rxfilename_;
+        feature_info_.use_cmvn = true;
+        ReadObject(global_cmvn_stats_rxfilename_, &feature_info_.global_cmvn_stats);
+    }
+
+    if (FileExists(pitch_conf_rxfilename_)) {
+        KALDI_LOG << "Using pitch in feature pipeline";
+        feature_info_.add_pitch = true;
+        ParseOptions po("");
+        feature_info_.pitch_opts.Register(&po);
+        feature_info_.pitch_process_opts.Register(&po);
+        ReadConfig(pitch_conf_rxfilename_, &po);
+    }
+
+    // Components below don't depend on each other, they are loaded
+    // in parallel if load-threads is above 1
+    vector<LoadTask> tasks;
+    tasks.push_back(LoadTask("am", [this]() { ReadAcousticModel(); }));
+    tasks.push_back(LoadTask("graph", [this]() { ReadGraph(); }));
+    bool has_ivector = FileExists(final_ie_rxfilename_);
+    if (has_ivector) {
+        tasks.push_back(LoadTask("ivector", [this]() { ReadIvectorExtractor(); }));
+    }
+    if (FileExists(winfo_rxfilename_)) {
+        tasks.push_back(LoadTask("winfo", [this]() { ReadWordBoundaryInfo(); }));
+    }
+
+    Timer timer;
+    RunLoadTasks(tasks, model_opts_.load_threads);
+    KALDI_LOG << "Loaded model in " << timer.Elapsed() << " seconds using "
+              << model_opts_.load_threads << " threads";
+    load_ms_ = timer.Elapsed() * 1000;
+
+    feature_info_.use_ivectors = has_ivector;
+    if (!has_ivector && nnet_->IvectorDim() > 0) {
+        KALDI_ERR << "Can't find required ivector extractor";
+    }
+}
+
+// Rescoring LMs take a lot of memory and are not needed for partial
+// results, so they are loaded when the first recognizer needs them.
+// Failure to load them disables rescoring instead of failing the
+// recognizer.
+void Model::LoadRescoring()
+{
+    std::call_once(rescore_once_, [this]() {
+        if (!model_opts_.rescore || !FileExists(carpa_rxfilename_))
+            return;
+
+        vector<LoadTask> tasks;
+        tasks.push_back(LoadTask("rescore_fst", [this]() {
+            KALDI_LOG << "Loading subtract G.fst model from " << std_fst_rxfilename_;
+            graph_lm_fst_ = fst::ReadAndPrepareLmFst(Rxfilename(std_fst_rxfilename_));
+            SetComponentBytes("rescore_fst", FileSize(std_fst_rxfilename_));
+        }));
+        tasks.push_back(LoadTask("carpa", [this]() {
+            KALDI_LOG << "Loading CARPA model from " << carpa_rxfilename_;
+            ReadObject(carpa_rxfilename_, &const_arpa_);
+            SetComponentBytes("carpa", FileSize(carpa_rxfilename_));
+        }));
+        if (FileExists(rnnlm_lm_rxfilename_)) {
+            tasks.push_back(LoadTask("rnnlm", [this]() { ReadRnnlm(); }));
+        }
+
+        try {
+            RunLoadTasks(tasks, model_opts_.load_threads);
+        } catch (const std::exception &e) {
+            KALDI_WARN << "Failed to load rescoring models, rescoring is disabled: " << e.what();
+            delete graph_lm_fst_;
+            graph_lm_fst_ = nullptr;
+            delete rnnlm_info_;
+            rnnlm_info_ = nullptr;
+            rnnlm_enabled_ = false;
+        }
+
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (graph_lm_fst_) {
+            lm_cache_ = new LatticeLmCache(*graph_lm_fst_, static_cast<int64>(model_opts_.lm_cache_mb) << 20);
+        }
+        if (rnnlm_enabled_) {
+            rnnlm_cache_ = new RnnlmStateCache(*rnnlm_info_, model_opts_.rnnlm_cache_states);
+        }
+    });
+}
+
+void Model::ReadAcousticModel()
+{
     trans_model_ = new kaldi::TransitionModel();
     nnet_ = new kaldi::nnet3::AmNnetSimple();
-    {
-        bool binary;
-        kaldi::Input ki(nnet3_rxfilename_, &binary);
-        trans_model_->Read(ki.Stream(), binary);
-        nnet_->Read(ki.Stream(), binary);
-        SetBatchnormTestMode(true, &(nnet_->GetNnet()));
-        SetDropoutTestMode(true, &(nnet_->GetNnet()));
-        nnet3::CollapseModel(nnet3::CollapseModelConfig(), &(nnet_->GetNnet()));
-    }
+
+    KALDI_LOG << "Loading acoustic model from " << nnet3_rxfilename_;
+    bool binary;
+    ModelInput ki(bundle_, nnet3_rxfilename_, &binary);
+    trans_model_->Read(ki.Stream(), binary);
+    nnet_->Read(ki.Stream(), binary);
+    SetBatchnormTestMode(true, &(nnet_->GetNnet()));
+    SetDropoutTestMode(true, &(nnet_->GetNnet()));
+    nnet3::CollapseModel(nnet3::CollapseModelConfig(), &(nnet_->GetNnet()));
 
     decodable_info_ = new nnet3::DecodableNnetSimpleLoopedInfo(decodable_opts_,
                                                                nnet_);
 
-    if (stat(final_ie_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Loading i-vector extractor from " << final_ie_rxfilename_;
-
-        OnlineIvectorExtractionConfig ivector_extraction_opts;
-        ivector_extraction_opts.splice_config_rxfilename = model_path_str_ + "/ivector/splice.conf";
-        ivector_extraction_opts.cmvn_config_rxfilename = model_path_str_ + "/ivector/online_cmvn.conf";
-        ivector_extraction_opts.lda_mat_rxfilename = model_path_str_ + "/ivector/final.mat";
-        ivector_extraction_opts.global_cmvn_stats_rxfilename = model_path_str_ + "/ivector/global_cmvn.stats";
-        ivector_extraction_opts.diag_ubm_rxfilename = model_path_str_ + "/ivector/final.dubm";
-        ivector_extraction_opts.ivector_extractor_rxfilename = model_path_str_ + "/ivector/final.ie";
-        ivector_extraction_opts.max_count = 100;
-
-        feature_info_.use_ivectors = true;
-        feature_info_.ivector_extractor_info.Init(ivector_extraction_opts);
-    } else if (nnet_->IvectorDim() > 0) {
-        KALDI_ERR << "Can't find required ivector extractor";
-    } else {
-        feature_info_.use_ivectors = false;
-    }
+    SetComponentBytes("am", static_cast<int64>(NumParameters(nnet_->GetNnet())) * sizeof(BaseFloat));
+}
 
-    if (stat(global_cmvn_stats_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Reading CMVN stats from " << global_cmvn_stats_rxfilename_;
-        feature_info_.use_cmvn = true;
-        ReadKaldiObject(global_cmvn_stats_rxfilename_, &feature_info_.global_cmvn_stats);
+void Model::ReadIvectorExtractor()
+{
+    KALDI_LOG << "Loading i-vector extractor from " << final_ie_rxfilename_;
+
+    OnlineIvectorExtractionConfig ivector_extraction_opts;
+    ivector_extraction_opts.splice_config_rxfilename = model_path_str_ + "/ivector/splice.conf";
+    ivector_extraction_opts.cmvn_config_rxfilename = model_path_str_ + "/ivector/online_cmvn.conf";
+    ivector_extraction_opts.lda_mat_rxfilename = model_path_str_ + "/ivector/final.mat";
+    ivector_extraction_opts.global_cmvn_stats_rxfilename = model_path_str_ + "/ivector/global_cmvn.stats";
+    ivector_extraction_opts.diag_ubm_rxfilename = model_path_str_ + "/ivector/final.dubm";
+    ivector_extraction_opts.ivector_extractor_rxfilename = model_path_str_ + "/ivector/final.ie";
+    ivector_extraction_opts.max_count = 100;
+
+    if (bundle_) {
+        // Init reads configs with std::ifstream which can't point inside
+        // the bundle. We parse them here and give Init an empty config,
+        // preset options are kept then.
+#ifdef _WIN32
+        const char *empty_config = "NUL";
+#else
+        const char *empty_config = "/dev/null";
+#endif
+        ReadConfig(ivector_extraction_opts.splice_config_rxfilename,
+                   &feature_info_.ivector_extractor_info.splice_opts);
+        ReadConfig(ivector_extraction_opts.cmvn_config_rxfilename,
+                   &feature_info_.ivector_extractor_info.cmvn_opts);
+        ivector_extraction_opts.splice_config_rxfilename = empty_config;
+        ivector_extraction_opts.cmvn_config_rxfilename = empty_config;
+        ivector_extraction_opts.lda_mat_rxfilename = Rxfilename(ivector_extraction_opts.lda_mat_rxfilename);
+        ivector_extraction_opts.global_cmvn_stats_rxfilename = Rxfilename(ivector_extraction_opts.global_cmvn_stats_rxfilename);
+        ivector_extraction_opts.diag_ubm_rxfilename = Rxfilename(ivector_extraction_opts.diag_ubm_rxfilename);
+        ivector_extraction_opts.ivector_extractor_rxfilename = Rxfilename(ivector_extraction_opts.ivector_extractor_rxfilename);
     }
 
-    if (stat(pitch_conf_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Using pitch in feature pipeline";
-        feature_info_.add_pitch = true;
-        ReadConfigsFromFile(pitch_conf_rxfilename_,
-                            &feature_info_.pitch_opts, &feature_info_.pitch_process_opts);
-    }
+    feature_info_.ivector_extractor_info.Init(ivector_extraction_opts);
+
+    SetComponentBytes("ivector", FileSize(model_path_str_ + "/ivector/final.ie") +
+                                 FileSize(model_path_str_ + "/ivector/final.dubm") +
+                                 FileSize(model_path_str_ + "/ivector/final.mat"));
+}
 
-    if (stat(hclg_fst_rxfilename_.c_str(), &buffer) == 0) {
+void Model::ReadGraph()
+{
+    if (FileExists(hclg_fst_rxfilename_)) {
         KALDI_LOG << "Loading HCLG from " << hclg_fst_rxfilename_;
-        hclg_fst_ = fst::ReadFstKaldiGeneric(hclg_fst_rxfilename_);
+        hclg_fst_ = ReadFst(hclg_fst_rxfilename_);
     } else {
         KALDI_LOG << "Loading HCL and G from " << hcl_fst_rxfilename_ << " " << g_fst_rxfilename_;
-        hcl_fst_ = fst::StdFst::Read(hcl_fst_rxfilename_);
-        g_fst_ = fst::StdFst::Read(g_fst_rxfilename_);
-        if (!ReadIntegerVectorSimple(disambig_rxfilename_, &disambig_)) {
+        hcl_fst_ = ReadFst(hcl_fst_rxfilename_);
+        g_fst_ = ReadFst(g_fst_rxfilename_);
+
+        ModelInput ki(bundle_, disambig_rxfilename_);
+        int32 id;
+        while (ki.Stream() >> id)
+            disambig_.push_back(id);
+        if (!ki.Stream().eof()) {
             KALDI_ERR << "Could not read disambig symbol table from file "
                       << disambig_rxfilename_;
         }
@@ -308,7 +572,8 @@ void Model::ReadDataFiles()
     }
     if (!word_syms_) {
         KALDI_LOG << "Loading words from " << word_syms_rxfilename_;
-        if (!(word_syms_ = fst::SymbolTable::ReadText(word_syms_rxfilename_)))
+        ModelInput ki(bundle_, word_syms_rxfilename_);
+        if (!(word_syms_ = fst::SymbolTable::ReadText(ki.Stream(), word_syms_rxfilename_)))
             KALDI_ERR << "Could not read symbol table from file "
                       << word_syms_rxfilename_;
         word_syms_loaded_ = word_syms_;
@@ -317,45 +582,118 @@ void Model::ReadDataFiles()
         KALDI_ERR << "Word symbol table empty";
     }
 
-    if (stat(winfo_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Loading winfo " << winfo_rxfilename_;
-        kaldi::WordBoundaryInfoNewOpts opts;
-        winfo_ = new kaldi::WordBoundaryInfo(opts, winfo_rxfilename_);
+    if (hclg_fst_) {
+        SetComponentBytes("graph", FileSize(hclg_fst_rxfilename_));
+    } else {
+        SetComponentBytes("graph", FileSize(hcl_fst_rxfilename_) + FileSize(g_fst_rxfilename_));
     }
 
-    if (stat(carpa_rxfilename_.c_str(), &buffer) == 0) {
+    // Approximate, symbol text plus both index entries
+    int64 word_bytes = 0;
+    for (const auto &item : *word_syms_)
+        word_bytes += item.Symbol().size() + sizeof(string) + 2 * sizeof(int64);
+    SetComponentBytes("words", word_bytes);
+}
+
+void Model::ReadWordBoundaryInfo()
+{
+    KALDI_LOG << "Loading winfo " << winfo_rxfilename_;
+    kaldi::WordBoundaryInfoNewOpts opts;
+    ModelInput ki(bundle_, winfo_rxfilename_);
+    winfo_ = new kaldi::WordBoundaryInfo(opts);
+    winfo_->Init(ki.Stream());
+
+    SetComponentBytes("winfo", FileSize(winfo_rxfilename_));
+}
 
-        KALDI_LOG << "Loading subtract G.fst model from " << std_fst_rxfilename_;
-        graph_lm_fst_ = fst::ReadAndPrepareLmFst(std_fst_rxfilename_);
-        KALDI_LOG << "Loading CARPA model from " << carpa_rxfilename_;
-        ReadKaldiObject(carpa_rxfilename_, &const_arpa_);
+void Model::ReadRnnlm()
+{
+    KALDI_LOG << "Loading RNNLM model from " << rnnlm_lm_rxfilename_;
+
+    ReadObject(rnnlm_lm_rxfilename_, &rnnlm);
+    Matrix<BaseFloat> feature_embedding_mat;
+    ReadObject(rnnlm_feat_embedding_rxfilename_, &feature_embedding_mat);
+    SparseMatrix<BaseFloat> word_feature_mat;
+    {
+       ModelInput input(bundle_, rnnlm_word_feats_rxfilename_);
+       int32 feature_dim = feature_embedding_mat.NumRows();
+       rnnlm::ReadSparseWordFeatures(input.Stream(), feature_dim,
+                         &word_feature_mat);
     }
+    Matrix<BaseFloat> wm(word_feature_mat.NumRows(), feature_embedding_mat.NumCols());
+    wm.AddSmatMat(1.0, word_feature_mat, kNoTrans,
+                  feature_embedding_mat, 0.0);
+    word_embedding_mat.Resize(wm.NumRows(), wm.NumCols(), kUndefined);
+    word_embedding_mat.CopyFromMat(wm);
 
-    // RNNLM Rescoring
-    if (stat(rnnlm_lm_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Loading RNNLM model from " << rnnlm_lm_rxfilename_;
+    ReadConfig(rnnlm_config_rxfilename_, &rnnlm_compute_opts);
 
-        ReadKaldiObject(rnnlm_lm_rxfilename_, &rnnlm);
-        Matrix<BaseFloat> feature_embedding_mat;
-        ReadKaldiObject(rnnlm_feat_embedding_rxfilename_, &feature_embedding_mat);
-        SparseMatrix<BaseFloat> word_feature_mat;
-        {
-           Input input(rnnlm_word_feats_rxfilename_);
-           int32 feature_dim = feature_embedding_mat.NumRows();
-           rnnlm::ReadSparseWordFeatures(input.Stream(), feature_dim,
-                             &word_feature_mat);
-        }
-        Matrix<BaseFloat> wm(word_feature_mat.NumRows(), feature_embedding_mat.NumCols());
-        wm.AddSmatMat(1.0, word_feature_mat, kNoTrans,
-                      feature_embedding_mat, 0.0);
-        word_embedding_mat.Resize(wm.NumRows(), wm.NumCols(), kUndefined);
-        word_embedding_mat.CopyFromMat(wm);
+    // Compiled once here and shared by all recognizers
+    rnnlm_info_ = new kaldi::rnnlm::RnnlmComputeStateInfo(rnnlm_compute_opts, rnnlm, word_embedding_mat);
+
+    SetComponentBytes("rnnlm", (static_cast<int64>(NumParameters(rnnlm)) +
+                                word_embedding_mat.NumRows() * word_embedding_mat.NumCols()) * sizeof(BaseFloat));
 
-        ReadConfigFromFile(rnnlm_config_rxfilename_, &rnnlm_compute_opts);
+    rnnlm_enabled_ = true;
+}
+
+int64 Model::FileSize(const string &filename)
+{
+    if (bundle_) {
+        uint64 offset, size;
+        if (!bundle_->Contains(filename))
+            return 0;
+        bundle_->Locate(filename, &offset, &size);
+        return size;
+    }
+
+    struct stat buffer;
+    if (stat(filename.c_str(), &buffer) != 0)
+        return 0;
+    return buffer.st_size;
+}
+
+void Model::SetComponentBytes(const string &component, int64 bytes)
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_[component].bytes = bytes;
+}
 
-        rnnlm_enabled_ = true;
+string Model::GetStats()
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    json::JSON obj = ComponentStatsJson(stats_, load_ms_);
+    if (lm_cache_) {
+        obj["lm_cache"]["bytes"] = lm_cache_->Bytes();
+        obj["lm_cache"]["hits"] = lm_cache_->Hits();
+        obj["lm_cache"]["misses"] = lm_cache_->Misses();
+    }
+    if (rnnlm_cache_) {
+        RnnlmCacheStats stats = rnnlm_cache_->GetStats();
+        obj["rnnlm_cache"]["evictions"] = stats.evictions;
+        obj["rnnlm_cache"]["hits"] = stats.hits;
+        obj["rnnlm_cache"]["misses"] = stats.misses;
+        obj["rnnlm_cache"]["states"] = stats.states;
+        obj["rnnlm_cache"]["compute_ms"] = stats.compute_seconds * 1000;
     }
+    return obj.dump();
+}
 
+json::JSON ComponentStatsJson(const map<string, ComponentStats> &stats, float load_ms)
+{
+    json::JSON obj;
+    int64 total_bytes = 0;
+    obj["components"] = json::Object();
+    for (const auto &it : stats) {
+        json::JSON component;
+        component["bytes"] = it.second.bytes;
+        component["load_ms"] = it.second.load_ms;
+        obj["components"][it.first] = component;
+        total_bytes += it.second.bytes;
+    }
+    obj["bytes"] = total_bytes;
+    obj["load_ms"] = load_ms;
+    return obj;
 }
 
 void Model::Ref() 
@@ -363,6 +701,17 @@ void Model::Ref()
     std::atomic_fetch_add_explicit(&ref_cnt_, 1, std::memory_order_relaxed);
 }
 
+// Takes a reference unless the model is already being destroyed
+bool Model::TryRef()
+{
+    int cnt = ref_cnt_.load(std::memory_order_relaxed);
+    while (cnt > 0) {
+        if (ref_cnt_.compare_exchange_weak(cnt, cnt + 1, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
 void Model::Unref() 
 {
     if (std::atomic_fetch_sub_explicit(&ref_cnt_, 1, std::memory_order_release) == 1) {
@@ -371,6 +720,174 @@ void Model::Unref()
     }
 }
 
+// Models in the registry are keyed by canonical path. Null value means
+// the model is being loaded by another thread, we wait for it instead
+// of loading the same model twice.
+static std::mutex registry_mutex;
+static std::condition_variable registry_cv;
+static map<string, Model *> registry;
+static int64 registry_hits = 0;
+static int64 registry_misses = 0;
+
+static string CanonicalPath(const char *path)
+{
+#ifdef _WIN32
+    char buf[_MAX_PATH];
+    if (_fullpath(buf, path, _MAX_PATH))
+        return buf;
+#else
+    char *real = realpath(path, nullptr);
+    if (real) {
+        string res(real);
+        free(real);
+        return res;
+    }
+#endif
+    return path;
+}
+
+Model *Model::Acquire(const char *model_path)
+{
+    string key = CanonicalPath(model_path);
+
+    std::unique_lock<std::mutex> lock(registry_mutex);
+    for (;;) {
+        auto it = registry.find(key);
+        if (it == registry.end())
+            break;
+        if (!it->second) {
+            registry_cv.wait(lock);
+            continue;
+        }
+        if (it->second->TryRef()) {
+            registry_hits++;
+            KALDI_LOG << "Reusing loaded model " << key;
+            return it->second;
+        }
+        // The last reference is gone and the model is being destroyed
+        break;
+    }
+    registry_misses++;
+    registry[key] = nullptr;
+    lock.unlock();
+
+    Model *model;
+    try {
+        model = new Model(model_path);
+    } catch (...) {
+        lock.lock();
+        registry.erase(key);
+        registry_cv.notify_all();
+        throw;
+    }
+    model->registry_key_ = key;
+
+    lock.lock();
+    registry[key] = model;
+    registry_cv.notify_all();
+    return model;
+}
+
+void Model::GetRegistryStats(int64 *hits, int64 *misses)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    *hits = registry_hits;
+    *misses = registry_misses;
+}
+
+// Runs recognizers over synthetic audio so that decoder, feature pipeline,
+// i-vector extractor, lattice and rescoring code and allocators are hot
+// before the first real request. Returns the time spent in seconds.
+float Model::Warmup(float seconds, int num_threads)
+{
+    Timer timer;
+
+    float sample_frequency = feature_info_.feature_type == "mfcc" ?
+        feature_info_.mfcc_opts.frame_opts.samp_freq :
+        feature_info_.fbank_opts.frame_opts.samp_freq;
+    int num_samples = static_cast<int>(seconds * sample_frequency);
+
+    // Loud tone with noise for 0.6 seconds and quiet noise for the rest of
+    // every second, so both speech and silence paths are taken
+    vector<short> audio(num_samples);
+    uint32 seed = 1;
+    for (int i = 0; i < num_samples; i++) {
+        seed = seed * 1664525 + 1013904223;
+        float t = i / sample_frequency;
+        float noise = ((seed >> 16) & 0xffff) / 32768.0f - 1.0f;
+        float tone = sin(2 * M_PI * 220 * t);
+        float amplitude = fmod(t, 1.0f) < 0.6f ? 4000.0f : 50.0f;
+        audio[i] = amplitude * (0.5f * noise + 0.5f * tone);
+    }
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        try {
+            Recognizer rec(this, sample_frequency);
+            rec.SetWords(true);
+            int chunk = static_cast<int>(sample_frequency * 0.2);
+            for (int i = 0; i < num_samples; i += chunk) {
+                if (rec.AcceptWaveform(audio.data() + i, std::min(chunk, num_samples - i)))
+                    rec.Result();
+                else
+                    rec.PartialResult();
+            }
+            rec.FinalResult();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+
+    vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++) {
+        HelperThreadStarted();
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+        HelperThreadStopped();
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    KALDI_LOG << "Warmed up model with " << std::max(num_threads, 1) << " x "
+              << seconds << " seconds of audio in " << timer.Elapsed() << " seconds";
+    return timer.Elapsed();
+}
+
+// Model data loaded before fork() stays in copy-on-write pages shared by
+// the parent and the workers as long as nobody writes to it. Lazily loaded
+// parts would be loaded privately in every worker, so we load them here.
+// Threads don't survive fork, a forked worker would wait forever for a
+// helper thread of the parent or for a lock it held.
+void Model::PreloadForFork()
+{
+    int num_threads = NumHelperThreads();
+    if (num_threads > 0) {
+        KALDI_ERR << "Can't preload model for forked workers, " << num_threads
+                  << " helper threads are running";
+    }
+    LoadRescoring();
+    KALDI_LOG << "Model is preloaded for forked workers";
+}
+
+// Started on first use, models used only synchronously have no threads
+Executor *Model::GetExecutor()
+{
+    std::call_once(executor_once_, [this]() {
+        int num_threads = model_opts_.async_threads;
+        if (num_threads <= 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        executor_ = new Executor(num_threads);
+    });
+    return executor_;
+}
+
 int Model::FindWord(const char *word)
 {
     if (!word_syms_)
@@ -380,6 +897,15 @@ int Model::FindWord(const char *word)
 }
 
 Model::~Model() {
+    delete executor_;
+
+    if (!registry_key_.empty()) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto it = registry.find(registry_key_);
+        if (it != registry.end() && it->second == this)
+            registry.erase(it);
+    }
+
     delete decodable_info_;
     delete trans_model_;
     delete nnet_;
@@ -389,5 +915,9 @@ Model::~Model() {
     delete hclg_fst_;
     delete hcl_fst_;
     delete g_fst_;
+    delete lm_cache_;
     delete graph_lm_fst_;
+    delete rnnlm_cache_;
+    delete rnnlm_info_;
+    delete bundle_;
 }
@@ -31,30 +31,105 @@
 #include "nnet3/nnet-utils.h"
 #include "rnnlm/rnnlm-utils.h"
 #include "rnnlm/rnnlm-lattice-rescoring.h"
+#include "model_bundle.h"
+#include "executor.h"
+#include "json.h"
+#include "lattice_lm_fst.h"
+#include "rnnlm_cache.h"
 #include <atomic>
+#include <functional>
+#include <mutex>
 
 using namespace kaldi;
 using namespace std;
 
 class Recognizer;
 
+struct ModelOptions {
+    bool mmap_graph;
+    int32 load_threads;
+    bool rescore;
+    int32 async_threads;
+    int32 lm_cache_mb;
+    int32 rnnlm_cache_states;
+
+    ModelOptions(): mmap_graph(true), load_threads(1), rescore(true), async_threads(0),
+                    lm_cache_mb(128), rnnlm_cache_states(2000) { }
+
+    void Register(OptionsItf *opts) {
+        opts->Register("mmap-graph", &mmap_graph, "Map aligned const HCLG graph "
+                       "into memory instead of reading it (see vosk_align_graph)");
+        opts->Register("load-threads", &load_threads, "Number of threads to load "
+                       "independent model components (AM, graph, LMs) in parallel");
+        opts->Register("rescore", &rescore, "Rescore results with rescore/ and rnnlm/ "
+                       "language models if present. They are loaded on first use");
+        opts->Register("async-threads", &async_threads, "Number of threads decoding "
+                       "audio of asynchronous recognizers, 0 for the number of cores");
+        opts->Register("lm-cache-mb", &lm_cache_mb, "Memory limit in megabytes for "
+                       "rescoring G.fst states shared by the recognizers");
+        opts->Register("rnnlm-cache-states", &rnnlm_cache_states, "Number of RNNLM "
+                       "states kept between utterances, each takes tens of kilobytes");
+    }
+};
+
+// Memory and load time of a model component, see vosk_model_get_stats.
+// Bytes are parameter sizes or file sizes for data kept as is in memory.
+struct ComponentStats {
+    int64 bytes = 0;
+    float load_ms = 0;
+};
+
+json::JSON ComponentStatsJson(const map<string, ComponentStats> &stats, float load_ms);
+
 class Model {
 
 public:
     Model(const char *model_path);
     void Ref();
     void Unref();
+
+    // Process-wide registry, returns the already loaded model for the same
+    // canonical path with a new reference or loads a new one
+    static Model *Acquire(const char *model_path);
+    static void GetRegistryStats(int64 *hits, int64 *misses);
     int FindWord(const char *word);
+    float Warmup(float seconds, int num_threads);
+    string GetStats();
+    void PreloadForFork();
+    Executor *GetExecutor();
 
 protected:
     ~Model();
     void ConfigureV1();
     void ConfigureV2();
     void ReadDataFiles();
+    void ReadAcousticModel();
+    void ReadIvectorExtractor();
+    void ReadGraph();
+    void ReadWordBoundaryInfo();
+    void ReadRnnlm();
+    void LoadRescoring();
+
+    typedef pair<string, std::function<void()> > LoadTask;
+    void RunLoadTasks(const vector<LoadTask> &tasks, int32 num_threads);
+    int64 FileSize(const string &filename);
+    void SetComponentBytes(const string &component, int64 bytes);
+    bool TryRef();
+
+    // Model files are either in the model folder or in the bundle
+    bool FileExists(const string &filename);
+    string Rxfilename(const string &filename);
+    fst::Fst<fst::StdArc> *ReadFst(const string &filename);
+    void ReadConfig(const string &filename, ParseOptions *po);
+    template<class C> void ReadConfig(const string &filename, C *c);
+    template<class C> void ReadObject(const string &filename, C *c);
 
     friend class Recognizer;
 
     string model_path_str_;
+    string registry_key_;
+    ModelBundle *bundle_ = nullptr;
+    ModelOptions model_opts_;
     string nnet3_rxfilename_;
     string hclg_fst_rxfilename_;
     string hcl_fst_rxfilename_;
@@ -93,12 +168,23 @@ protected:
     fst::Fst<fst::StdArc> *g_fst_ = nullptr;
 
     fst::VectorFst<fst::StdArc> *graph_lm_fst_ = nullptr;
+    LatticeLmCache *lm_cache_ = nullptr;
     kaldi::ConstArpaLm const_arpa_;
 
     kaldi::rnnlm::RnnlmComputeStateComputationOptions rnnlm_compute_opts;
     CuMatrix<BaseFloat> word_embedding_mat;
     kaldi::nnet3::Nnet rnnlm;
+    kaldi::rnnlm::RnnlmComputeStateInfo *rnnlm_info_ = nullptr;
+    RnnlmStateCache *rnnlm_cache_ = nullptr;
     bool rnnlm_enabled_ = false;
+    std::once_flag rescore_once_;
+
+    Executor *executor_ = nullptr;
+    std::once_flag executor_once_;
+
+    std::mutex stats_mutex_;
+    map<string, ComponentStats> stats_;
+    float load_ms_ = 0;
 
     std::atomic<int> ref_cnt_;
 };
@@ -0,0 +1,204 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "model_bundle.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+ModelBundle::ModelBundle(const string &bundle_path) : path_(bundle_path) {
+
+#ifdef _WIN32
+    std::ifstream is(path_, std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+    if (!is) {
+        KALDI_ERR << "Failed to open model bundle " << path_;
+    }
+    size_ = is.tellg();
+    data_ = new char[size_];
+    is.seekg(0);
+    if (!is.read(data_, size_)) {
+        delete [] data_;
+        KALDI_ERR << "Failed to read model bundle " << path_;
+    }
+#else
+    int fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0) {
+        KALDI_ERR << "Failed to open model bundle " << path_ << ": " << strerror(errno);
+    }
+    struct stat buffer;
+    if (fstat(fd, &buffer) != 0) {
+        close(fd);
+        KALDI_ERR << "Failed to stat model bundle " << path_ << ": " << strerror(errno);
+    }
+    size_ = buffer.st_size;
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        KALDI_ERR << "Failed to map model bundle " << path_ << ": " << strerror(errno);
+    }
+    data_ = static_cast<char *>(data);
+
+    // Start reading the whole bundle ahead, so the following
+    // loads are served from the page cache
+    madvise(data_, size_, MADV_WILLNEED);
+#endif
+
+    uint64 pos = 0;
+    auto read = [&](void *out, uint64 len) {
+        if (pos + len > size_) {
+            KALDI_ERR << "Model bundle " << path_ << " is truncated";
+        }
+        memcpy(out, data_ + pos, len);
+        pos += len;
+    };
+
+    try {
+        char magic[sizeof(kBundleMagic) - 1];
+        uint32 version, num_entries;
+        read(magic, sizeof(magic));
+        if (memcmp(magic, kBundleMagic, sizeof(magic)) != 0) {
+            KALDI_ERR << "File " << path_ << " is not a model bundle";
+        }
+        read(&version, sizeof(version));
+        if (version != kBundleVersion) {
+            KALDI_ERR << "Unsupported model bundle version " << version << " in " << path_;
+        }
+        read(&num_entries, sizeof(num_entries));
+
+        for (uint32 i = 0; i < num_entries; i++) {
+            uint32 name_len;
+            read(&name_len, sizeof(name_len));
+            string name(name_len, '\0');
+            read(&name[0], name_len);
+            Entry entry;
+            read(&entry.offset, sizeof(entry.offset));
+            read(&entry.size, sizeof(entry.size));
+            if (entry.offset > size_ || entry.size > size_ - entry.offset) {
+                KALDI_ERR << "Model bundle " << path_ << " entry " << name << " is out of range";
+            }
+            entries_[name] = entry;
+        }
+    } catch (...) {
+#ifdef _WIN32
+        delete [] data_;
+#else
+        munmap(data_, size_);
+#endif
+        throw;
+    }
+
+    KALDI_LOG << "Mapped model bundle " << path_ << " with " << entries_.size() << " files";
+}
+
+ModelBundle::~ModelBundle() {
+#ifdef _WIN32
+    delete [] data_;
+#else
+    munmap(data_, size_);
+#endif
+}
+
+const ModelBundle::Entry *ModelBundle::Find(const string &filename) const
+{
+    string prefix = path_ + "/";
+    if (filename.compare(0, prefix.size(), prefix) != 0)
+        return nullptr;
+
+    auto it = entries_.find(filename.substr(prefix.size()));
+    if (it == entries_.end())
+        return nullptr;
+    return &it->second;
+}
+
+bool ModelBundle::Contains(const string &filename) const
+{
+    return Find(filename) != nullptr;
+}
+
+void ModelBundle::Locate(const string &filename, uint64 *offset, uint64 *size) const
+{
+    const Entry *entry = Find(filename);
+    if (!entry) {
+        KALDI_ERR << "File " << filename << " is missing in model bundle";
+    }
+    *offset = entry->offset;
+    *size = entry->size;
+}
+
+const char *ModelBundle::Data(const string &filename, uint64 *size) const
+{
+    uint64 offset;
+    Locate(filename, &offset, size);
+    return data_ + offset;
+}
+
+MemoryStreamBuf::MemoryStreamBuf(const char *data, uint64 size)
+{
+    char *begin = const_cast<char *>(data);
+    setg(begin, begin, begin + size);
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                                                   std::ios_base::openmode which)
+{
+    char *pos;
+    if (dir == std::ios_base::beg) {
+        pos = eback() + off;
+    } else if (dir == std::ios_base::cur) {
+        pos = gptr() + off;
+    } else {
+        pos = egptr() + off;
+    }
+    if (!(which & std::ios_base::in) || pos < eback() || pos > egptr())
+        return pos_type(off_type(-1));
+    setg(eback(), pos, egptr());
+    return pos_type(pos - eback());
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+ModelInput::ModelInput(const ModelBundle *bundle, const string &filename, bool *binary)
+{
+    if (!bundle) {
+        if (!input_.Open(filename, binary)) {
+            KALDI_ERR << "Error opening input stream " << filename;
+        }
+        return;
+    }
+
+    uint64 size;
+    const char *data = bundle->Data(filename, &size);
+    buf_.reset(new MemoryStreamBuf(data, size));
+    stream_.reset(new std::istream(buf_.get()));
+    if (binary && !InitKaldiInputStream(*stream_, binary)) {
+        KALDI_ERR << "Error reading header of " << filename;
+    }
+}
+
+std::istream &ModelInput::Stream()
+{
+    return stream_ ? *stream_ : input_.Stream();
+}
@@ -0,0 +1,97 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_MODEL_BUNDLE_H
+#define VOSK_MODEL_BUNDLE_H
+
+#include "base/kaldi-common.h"
+#include "util/kaldi-io.h"
+
+#include <istream>
+#include <map>
+#include <memory>
+
+using namespace kaldi;
+using namespace std;
+
+// Model bundle packs the whole model folder into a single file which is
+// mapped into memory in one shot. Layout, integers are in host byte order:
+//
+//   magic     "VOSKBNDL"
+//   uint32    format version
+//   uint32    number of entries
+//   entries   uint32 name length, name bytes, uint64 offset, uint64 size
+//   data      entry contents, each entry starts at kBundleAlignment boundary
+//
+// Entry names are paths relative to the model folder, like "am/final.mdl".
+// Bundles are written by vosk_pack_model.
+
+static const char kBundleMagic[] = "VOSKBNDL";
+static const uint32 kBundleVersion = 1;
+static const uint64 kBundleAlignment = 4096;
+
+class ModelBundle {
+
+public:
+    ModelBundle(const string &bundle_path);
+    ~ModelBundle();
+
+    const string &Path() const { return path_; }
+
+    // Files are addressed with the bundle path as a folder,
+    // for example "/data/model.vosk/am/final.mdl"
+    bool Contains(const string &filename) const;
+    void Locate(const string &filename, uint64 *offset, uint64 *size) const;
+    const char *Data(const string &filename, uint64 *size) const;
+
+private:
+    struct Entry {
+        uint64 offset;
+        uint64 size;
+    };
+    const Entry *Find(const string &filename) const;
+
+    string path_;
+    map<string, Entry> entries_;
+    char *data_ = nullptr;
+    uint64 size_ = 0;
+};
+
+// Read-only stream over memory block
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const char *data, uint64 size);
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+// Input over model file which is either a regular file or bundle entry,
+// similar to kaldi::Input. Text files are always read till the end of the
+// entry, not till the end of the bundle.
+class ModelInput {
+
+public:
+    ModelInput(const ModelBundle *bundle, const string &filename, bool *binary = nullptr);
+    std::istream &Stream();
+
+private:
+    kaldi::Input input_;
+    unique_ptr<MemoryStreamBuf> buf_;
+    unique_ptr<std::istream> stream_;
+};
+
+#endif /* VOSK_MODEL_BUNDLE_H */
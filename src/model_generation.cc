@@ -0,0 +1,111 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "model_generation.h"
+
+ModelGeneration::ModelGeneration(Model *model) : model_(model)
+{
+    model_->Ref();
+}
+
+ModelGeneration::~ModelGeneration()
+{
+    Wait();
+    if (loader_.joinable())
+        loader_.join();
+    model_->Unref();
+}
+
+Model *ModelGeneration::Acquire()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    model_->Ref();
+    return model_;
+}
+
+int ModelGeneration::Generation()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return generation_;
+}
+
+void ModelGeneration::Swap(Model *model)
+{
+    model->Ref();
+
+    Model *old_model;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        old_model = model_;
+        model_ = model;
+        generation_++;
+    }
+    // Old model stays alive while recognizers still use it
+    old_model->Unref();
+    KALDI_LOG << "Switched to model generation " << Generation();
+}
+
+bool ModelGeneration::Load(const char *model_path, float warmup_seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (loading_)
+        return false;
+    if (loader_.joinable())
+        loader_.join();
+
+    loading_ = true;
+    string path(model_path);
+    HelperThreadStarted();
+    loader_ = std::thread([this, path, warmup_seconds]() {
+        Model *model = nullptr;
+        try {
+            // Not taken from the registry, files might have
+            // changed under the same path
+            model = new Model(path.c_str());
+            if (warmup_seconds > 0)
+                model->Warmup(warmup_seconds, 1);
+            Swap(model);
+            model->Unref();
+        } catch (...) {
+            // Any failure must clear loading_, or Wait() never returns
+            string what = "unknown error";
+            try {
+                throw;
+            } catch (const std::exception &e) {
+                what = e.what();
+            } catch (...) {
+            }
+            KALDI_WARN << "Failed to load new model generation from " << path << ": " << what;
+            if (model)
+                model->Unref();
+            model = nullptr;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            load_ok_ = model != nullptr;
+            loading_ = false;
+            cv_.notify_all();
+        }
+        HelperThreadStopped();
+    });
+    return true;
+}
+
+bool ModelGeneration::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !loading_; });
+    return load_ok_;
+}
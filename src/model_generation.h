@@ -0,0 +1,57 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_MODEL_GENERATION_H
+#define VOSK_MODEL_GENERATION_H
+
+#include "model.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Holds the current model for new recognizers and replaces it with a newly
+// loaded one without interrupting recognizers created before. Recognizers
+// keep their own model reference, so the old model is released when the
+// last of them is freed.
+class ModelGeneration {
+
+public:
+    ModelGeneration(Model *model);
+    ~ModelGeneration();
+
+    // Returns the current model with a new reference
+    Model *Acquire();
+    int Generation();
+
+    void Swap(Model *model);
+
+    // Loads the model in a background thread, warms it up and swaps it
+    // in. Returns false if another load is still running.
+    bool Load(const char *model_path, float warmup_seconds);
+    // Waits for the background load, returns false if it failed
+    bool Wait();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    Model *model_;
+    int generation_ = 0;
+
+    std::thread loader_;
+    bool loading_ = false;
+    bool load_ok_ = true;
+};
+
+#endif /* VOSK_MODEL_GENERATION_H */
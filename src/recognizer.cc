@@ -17,6 +17,7 @@
 #include "fstext/fstext-utils.h"
 #include "lat/sausages.h"
 #include "language_model.h"
+#include "base/timer.h"
 
 using namespace fst;
 using namespace kaldi::nnet3;
@@ -43,7 +44,6 @@ Recognizer::Recognizer(Model *model, float sample_frequency) : model_(model), sp
             feature_pipeline_);
 
     InitState();
-    InitRescoring();
 }
 
 Recognizer::Recognizer(Model *model, float sample_frequency, char const *grammar) : model_(model), spk_model_(0), sample_frequency_(sample_frequency)
@@ -66,7 +66,6 @@ Recognizer::Recognizer(Model *model, float sample_frequency, char const *grammar
             feature_pipeline_);
 
     InitState();
-    InitRescoring();
 }
 
 Recognizer::Recognizer(Model *model, float sample_frequency, SpkModel *spk_model) : model_(model), spk_model_(spk_model), sample_frequency_(sample_frequency) {
@@ -91,24 +90,37 @@ Recognizer::Recognizer(Model *model, float sample_frequency, SpkModel *spk_model
             model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
             feature_pipeline_);
 
-    spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+    InitSpkFeature();
 
     InitState();
-    InitRescoring();
 }
 
 Recognizer::~Recognizer() {
+    // Pending asynchronous tasks use the recognizer
+    delete strand_;
+
+    if (pipelined_) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stop_worker_ = true;
+            queue_.clear();
+        }
+        queue_cv_.notify_all();
+        worker_.join();
+        HelperThreadStopped();
+    }
+
     delete decoder_;
     delete feature_pipeline_;
     delete silence_weighting_;
     delete g_fst_;
     delete decode_fst_;
     delete spk_feature_;
+    delete spk_stats_;
 
     delete lm_to_subtract_;
     delete carpa_to_add_;
     delete carpa_to_add_scale_;
-    delete rnnlm_info_;
     delete rnnlm_to_add_;
     delete rnnlm_to_add_scale_;
 
@@ -124,25 +136,24 @@ void Recognizer::InitState()
     frame_offset_ = 0;
     samples_processed_ = 0;
     samples_round_start_ = 0;
+    samples_pending_ = 0;
 
     state_ = RECOGNIZER_INITIALIZED;
 }
 
 void Recognizer::InitRescoring()
 {
-    if (model_->graph_lm_fst_) {
+    rescoring_initialized_ = true;
+    model_->LoadRescoring();
 
-        fst::CacheOptions cache_opts(true, -1);
-        fst::ArcMapFstOptions mapfst_opts(cache_opts);
-        fst::StdToLatticeMapper<BaseFloat> mapper;
+    if (model_->lm_cache_) {
 
-        lm_to_subtract_ = new fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> >(*model_->graph_lm_fst_, mapper, mapfst_opts);
+        lm_to_subtract_ = new LatticeLmFst(model_->lm_cache_);
         carpa_to_add_ = new ConstArpaLmDeterministicFst(model_->const_arpa_);
 
-        if (model_->rnnlm_enabled_) {
+        if (model_->rnnlm_cache_) {
            int lm_order = 4;
-           rnnlm_info_ = new kaldi::rnnlm::RnnlmComputeStateInfo(model_->rnnlm_compute_opts, model_->rnnlm, model_->word_embedding_mat);
-           rnnlm_to_add_ = new kaldi::rnnlm::KaldiRnnlmDeterministicFst(lm_order, *rnnlm_info_);
+           rnnlm_to_add_ = new CachedRnnlmFst(lm_order, model_->rnnlm_cache_);
            rnnlm_to_add_scale_ = new fst::ScaleDeterministicOnDemandFst(0.5, rnnlm_to_add_);
            carpa_to_add_scale_ = new fst::ScaleDeterministicOnDemandFst(-0.5, carpa_to_add_);
         }
@@ -157,6 +168,13 @@ void Recognizer::CleanUp()
     if (decoder_)
        frame_offset_ += decoder_->NumFramesDecoded();
 
+    ClearPartialWords();
+    samples_pending_ = 0;
+
+    if (spk_stats_)
+        spk_stats_->Reset();
+    spk_decided_frames_ = 0;
+
     // Each 10 minutes we drop the pipeline to save frontend memory in continuous processing
     // here we drop few frames remaining in the feature pipeline but hope it will not
     // cause a huge accuracy drop since it happens not very frequently.
@@ -178,10 +196,7 @@ void Recognizer::CleanUp()
             model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
             feature_pipeline_);
 
-        if (spk_model_) {
-            delete spk_feature_;
-            spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
-        }
+        InitSpkFeature();
     } else {
         decoder_->InitDecoding(frame_offset_);
     }
@@ -200,28 +215,80 @@ void Recognizer::UpdateSilenceWeights()
     }
 }
 
+void Recognizer::AdvanceDecoding()
+{
+    UpdateSilenceWeights();
+    decoder_->AdvanceDecoding();
+    UpdateSpkStats(false);
+    samples_pending_ = 0;
+}
+
+// Decoding audio in small steps gives fresh partials but adds per-step
+// overhead, big steps are faster. With a latency target the step is
+// chosen so that buffering the step and decoding it fits the target.
+float Recognizer::DecodeStep()
+{
+    if (latency_target_ <= 0)
+        return decode_step_;
+
+    float step = latency_target_ / (1.0 + GetRtf());
+    return std::min(std::max(step, 0.02f), 5.0f);
+}
+
+void Recognizer::SetDecodeStep(float step)
+{
+    // The worker thread must not decode while settings change
+    Drain();
+
+    if (step <= 0) {
+        KALDI_WARN << "Ignoring decode step " << step << ", it must be positive";
+        return;
+    }
+    decode_step_ = step;
+}
+
+void Recognizer::SetLatencyTarget(float latency)
+{
+    Drain();
+    latency_target_ = latency;
+}
+
+float Recognizer::GetRtf()
+{
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (audio_time_ == 0)
+        return 0;
+    return decode_time_ / audio_time_;
+}
+
 void Recognizer::SetMaxAlternatives(int max_alternatives)
 {
+    Drain();
     max_alternatives_ = max_alternatives;
 }
 
 void Recognizer::SetWords(bool words)
 {
+    Drain();
     words_ = words;
 }
 
 void Recognizer::SetPartialWords(bool partial_words)
 {
+    Drain();
     partial_words_ = partial_words;
+    ClearPartialWords();
 }
 
 void Recognizer::SetNLSML(bool nlsml)
 {
+    Drain();
     nlsml_ = nlsml;
 }
 
 void Recognizer::SetEndpointerMode(int mode)
 {
+    Drain();
     float scale = 1.0;
     switch(mode) {
         case 1:
@@ -243,6 +310,7 @@ void Recognizer::SetEndpointerMode(int mode)
 
 void Recognizer::SetEndpointerDelays(float t_start_max, float t_end, float t_max)
 {
+    Drain();
     float rule1, rule2, rule3, rule4, rule5;
 
     rule1 = t_start_max;
@@ -263,17 +331,99 @@ void Recognizer::SetEndpointerDelays(float t_start_max, float t_end, float t_max
 
 void Recognizer::SetSpkModel(SpkModel *spk_model)
 {
+    Drain();
     if (state_ == RECOGNIZER_RUNNING) {
         KALDI_ERR << "Can't add speaker model to already running recognizer";
         return;
     }
     spk_model_ = spk_model;
     spk_model_->Ref();
+    InitSpkFeature();
+    InitSpkStats();
+}
+
+// Options which change MFCC values, the downsampling flags only
+// select the accepted sample rates
+static bool SameMfccOptions(const MfccOptions &a, const MfccOptions &b)
+{
+    const FrameExtractionOptions &fa = a.frame_opts, &fb = b.frame_opts;
+    const MelBanksOptions &ma = a.mel_opts, &mb = b.mel_opts;
+    return fa.samp_freq == fb.samp_freq && fa.frame_shift_ms == fb.frame_shift_ms &&
+        fa.frame_length_ms == fb.frame_length_ms && fa.dither == fb.dither &&
+        fa.preemph_coeff == fb.preemph_coeff && fa.remove_dc_offset == fb.remove_dc_offset &&
+        fa.window_type == fb.window_type && fa.round_to_power_of_two == fb.round_to_power_of_two &&
+        fa.blackman_coeff == fb.blackman_coeff && fa.snip_edges == fb.snip_edges &&
+        ma.num_bins == mb.num_bins && ma.low_freq == mb.low_freq && ma.high_freq == mb.high_freq &&
+        ma.vtln_low == mb.vtln_low && ma.vtln_high == mb.vtln_high && ma.htk_mode == mb.htk_mode &&
+        a.num_ceps == b.num_ceps && a.use_energy == b.use_energy && a.energy_floor == b.energy_floor &&
+        a.raw_energy == b.raw_energy && a.cepstral_lifter == b.cepstral_lifter && a.htk_compat == b.htk_compat;
+}
+
+// If the speaker model uses the same MFCC as the acoustic model, speaker
+// features are read from the input of the feature pipeline instead of
+// computing the same frames twice. Released models differ (40 against 30
+// mel bins and cepstra, snip-edges true against false), so for them the
+// speaker front-end is still computed separately.
+void Recognizer::InitSpkFeature()
+{
+    delete spk_feature_;
+    spk_feature_ = nullptr;
+
+    if (!spk_model_)
+        return;
+
+    const OnlineNnet2FeaturePipelineInfo &info = model_->feature_info_;
+    if (info.feature_type == "mfcc" && !info.add_pitch && !info.use_cmvn &&
+        SameMfccOptions(info.mfcc_opts, spk_model_->spkvector_mfcc_opts)) {
+        return;
+    }
+    KALDI_VLOG(1) << "Speaker MFCC options differ from the acoustic model, "
+                  << "computing speaker features separately";
     spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
 }
 
+OnlineFeatureInterface *Recognizer::SpkFeature()
+{
+    return spk_feature_ ? spk_feature_ : feature_pipeline_->InputFeature();
+}
+
+void Recognizer::SetSpkIncremental(bool incremental)
+{
+    Drain();
+    if (state_ == RECOGNIZER_RUNNING) {
+        KALDI_ERR << "Can't change speaker mode of already running recognizer";
+        return;
+    }
+    spk_incremental_ = incremental;
+    InitSpkStats();
+}
+
+void Recognizer::SetPartialSpk(bool partial_spk)
+{
+    Drain();
+    partial_spk_ = partial_spk;
+    partial_frames_ = -1;
+}
+
+void Recognizer::InitSpkStats()
+{
+    delete spk_stats_;
+    spk_stats_ = nullptr;
+    spk_decided_frames_ = 0;
+
+    if (!spk_incremental_ || !spk_model_)
+        return;
+
+    if (!spk_model_->split_nnet_) {
+        KALDI_WARN << "Speaker model doesn't support incremental mode, vectors are computed at the end of utterance";
+        return;
+    }
+    spk_stats_ = new OnlineXvectorStats(spk_model_);
+}
+
 void Recognizer::SetGrm(char const *grammar)
 {
+    Drain();
     if (state_ == RECOGNIZER_RUNNING) {
         KALDI_ERR << "Can't add grammar to already running recognizer";
         return;
@@ -294,7 +444,9 @@ void Recognizer::SetGrm(char const *grammar)
 
     samples_round_start_ += samples_processed_;
     samples_processed_ = 0;
+    samples_pending_ = 0;
     frame_offset_ = 0;
+    ClearPartialWords();
 
     delete decoder_;
     delete feature_pipeline_;
@@ -308,10 +460,10 @@ void Recognizer::SetGrm(char const *grammar)
             *decode_fst_,
             feature_pipeline_);
 
-    if (spk_model_) {
-        delete spk_feature_;
-        spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
-    }
+    InitSpkFeature();
+    if (spk_stats_)
+        spk_stats_->Reset();
+    spk_decided_frames_ = 0;
 
     state_ = RECOGNIZER_INITIALIZED;
 }
@@ -365,78 +517,368 @@ void Recognizer::UpdateGrammarFst(char const *grammar)
 
 bool Recognizer::AcceptWaveform(const char *data, int len)
 {
-    Vector<BaseFloat> wave;
-    wave.Resize(len / 2, kUndefined);
-    for (int i = 0; i < len / 2; i++)
-        wave(i) = *(((short *)data) + i);
-    return AcceptWaveform(wave);
+    return AcceptWaveform((const short *)data, len / 2);
 }
 
 bool Recognizer::AcceptWaveform(const short *sdata, int len)
 {
-    Vector<BaseFloat> wave;
-    wave.Resize(len, kUndefined);
+    // The buffer only grows, so steady stream of equal chunks
+    // doesn't allocate
+    if (wave_buffer_.Dim() < len)
+        wave_buffer_.Resize(len, kUndefined);
+
+    // Plain loop over raw pointers, compiler vectorizes it
+    BaseFloat *wave_data = wave_buffer_.Data();
     for (int i = 0; i < len; i++)
-        wave(i) = sdata[i];
+        wave_data[i] = sdata[i];
+
+    SubVector<BaseFloat> wave(wave_buffer_, 0, len);
     return AcceptWaveform(wave);
 }
 
 bool Recognizer::AcceptWaveform(const float *fdata, int len)
 {
-    Vector<BaseFloat> wave;
-    wave.Resize(len, kUndefined);
-    for (int i = 0; i < len; i++)
-        wave(i) = fdata[i];
+    // Float samples are used in place without a copy
+    SubVector<BaseFloat> wave(const_cast<float *>(fdata), len);
     return AcceptWaveform(wave);
 }
 
-bool Recognizer::AcceptWaveform(Vector<BaseFloat> &wdata)
+bool Recognizer::AcceptWaveform(const VectorBase<BaseFloat> &wdata)
 {
     // Cleanup if we finalized previous utterance or the whole feature pipeline
     if (!(state_ == RECOGNIZER_RUNNING || state_ == RECOGNIZER_INITIALIZED)) {
         CleanUp();
     }
-    state_ = RECOGNIZER_RUNNING;
+    // Not written while running, the pipelined worker reads it
+    if (state_ != RECOGNIZER_RUNNING) {
+        state_ = RECOGNIZER_RUNNING;
+    }
 
-    int step = static_cast<int>(sample_frequency_ * 0.2);
+    // In incremental and pipelined modes speaker features are computed in
+    // the decoding thread, together with the audio of the same utterance
+    if (!pipelined_ && spk_feature_ && !spk_stats_) {
+        spk_feature_->AcceptWaveform(sample_frequency_, wdata);
+    }
+
+    if (pipelined_) {
+        return PushWaveform(wdata);
+    }
+
+    DecodeWaveform(wdata);
+    return decoder_->EndpointDetected(endpoint_config_);
+}
+
+void Recognizer::DecodeWaveform(const VectorBase<BaseFloat> &wdata)
+{
+    Timer timer;
+
+    if (spk_feature_ && (spk_stats_ || pipelined_)) {
+        spk_feature_->AcceptWaveform(sample_frequency_, wdata);
+    }
+
+    // In adaptive mode the decoding is deferred until we collect a step of
+    // audio, small chunks from the client are decoded together then
+    int step = std::max(1, static_cast<int>(sample_frequency_ * DecodeStep()));
     for (int i = 0; i < wdata.Dim(); i+= step) {
         SubVector<BaseFloat> r = wdata.Range(i, std::min(step, wdata.Dim() - i));
         feature_pipeline_->AcceptWaveform(sample_frequency_, r);
-        UpdateSilenceWeights();
-        decoder_->AdvanceDecoding();
+        samples_pending_ += r.Dim();
+        if (latency_target_ <= 0 || samples_pending_ >= step) {
+            AdvanceDecoding();
+        }
     }
+
+    std::lock_guard<std::mutex> lock(queue_mutex_);
     samples_processed_ += wdata.Dim();
+    decode_time_ += timer.Elapsed();
+    audio_time_ += wdata.Dim() / sample_frequency_;
+}
 
-    if (spk_feature_) {
-        spk_feature_->AcceptWaveform(sample_frequency_, wdata);
+// In pipelined mode the caller thread converts and queues audio while the
+// worker thread runs the feature pipeline and the decoder on the previous
+// chunks. OnlineNnet2FeaturePipeline accepts only audio and the decoder
+// reads its MFCC frames without locking, so base features can't be
+// computed on another thread than the decoder, the split is at the audio
+// queue instead. The queue is bounded, the caller waits if the decoder
+// falls behind.
+//
+// At an endpoint the worker ends the utterance itself, queues its lattice
+// and goes on decoding the next one. AcceptWaveform returns true while
+// results are queued and Result() formats the oldest one, so taking the
+// result doesn't wait for the audio queued after the endpoint.
+void Recognizer::SetPipelined(bool pipelined)
+{
+    if (pipelined == pipelined_)
+        return;
+
+    if (pipelined) {
+        stop_worker_ = false;
+        pipelined_ = true;
+        HelperThreadStarted();
+        worker_ = std::thread(&Recognizer::WorkerLoop, this);
+    } else {
+        Drain(true);
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stop_worker_ = true;
+        }
+        queue_cv_.notify_all();
+        worker_.join();
+        HelperThreadStopped();
+        pipelined_ = false;
     }
+}
 
-    if (decoder_->EndpointDetected(endpoint_config_)) {
-        return true;
+// Returns the endpoint flag for AcceptWaveform
+bool Recognizer::PushWaveform(const VectorBase<BaseFloat> &wdata)
+{
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    queue_cv_.wait(lock, [this]() {
+        return queue_.size() < kMaxQueuedChunks || worker_error_;
+    });
+    if (worker_error_) {
+        // Report decoding failure to the caller of AcceptWaveform
+        std::exception_ptr error = worker_error_;
+        worker_error_ = nullptr;
+        queue_.clear();
+        std::rethrow_exception(error);
+    }
+
+    // Reuse buffers of the processed chunks
+    Vector<BaseFloat> chunk;
+    if (!free_chunks_.empty()) {
+        chunk.Swap(&free_chunks_.back());
+        free_chunks_.pop_back();
+    }
+    chunk.Resize(wdata.Dim(), kUndefined);
+    chunk.CopyFromVec(wdata);
+    queue_.push_back(Vector<BaseFloat>());
+    queue_.back().Swap(&chunk);
+    queue_cv_.notify_all();
+
+    return !results_.empty();
+}
+
+void Recognizer::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    for (;;) {
+        queue_cv_.wait(lock, [this]() {
+            return stop_worker_ || !queue_.empty();
+        });
+        if (stop_worker_)
+            return;
+
+        Vector<BaseFloat> chunk;
+        chunk.Swap(&queue_.front());
+        queue_.pop_front();
+        worker_busy_ = true;
+        bool split = !drain_all_;
+        lock.unlock();
+
+        bool endpoint = false;
+        UtteranceResult result;
+        std::exception_ptr error;
+        try {
+            DecodeWaveform(chunk);
+            endpoint = split && decoder_->EndpointDetected(endpoint_config_);
+            if (endpoint)
+                EndUtterance(&result);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        lock.lock();
+        if (endpoint && !error)
+            results_.push_back(result);
+        if (error && !worker_error_)
+            worker_error_ = error;
+        free_chunks_.push_back(Vector<BaseFloat>());
+        free_chunks_.back().Swap(&chunk);
+        worker_busy_ = false;
+        queue_cv_.notify_all();
     }
+}
 
-    return false;
+void Recognizer::SetCallback(RecognizerCallback callback, void *user_data)
+{
+    // Tasks already posted to the executor may be reporting events
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    callback_ = callback;
+    callback_user_data_ = user_data;
+}
+
+bool Recognizer::HasCallback()
+{
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    return callback_ != nullptr;
+}
+
+void Recognizer::Notify(int event, const char *json)
+{
+    RecognizerCallback callback;
+    void *user_data;
+    {
+        std::lock_guard<std::mutex> lock(callback_mutex_);
+        callback = callback_;
+        user_data = callback_user_data_;
+    }
+    if (callback)
+        callback(user_data, event, json);
+}
+
+// Audio is copied and decoded on the model executor. Tasks of one
+// recognizer run in order, so events are reported in audio order.
+void Recognizer::AcceptWaveformAsync(const char *data, int len)
+{
+    if (!strand_)
+        strand_ = new Strand(model_->GetExecutor());
+
+    vector<char> chunk(data, data + len);
+    PostAsync([this, chunk]() {
+        if (AcceptWaveform(chunk.data(), chunk.size())) {
+            last_partial_.clear();
+            Notify(RECOGNIZER_EVENT_RESULT, Result());
+        } else if (HasCallback()) {
+            const char *partial = PartialResult();
+            if (last_partial_ != partial) {
+                last_partial_ = partial;
+                Notify(RECOGNIZER_EVENT_PARTIAL, partial);
+            }
+        }
+    });
+}
+
+void Recognizer::FinishAsync()
+{
+    if (!strand_)
+        strand_ = new Strand(model_->GetExecutor());
+
+    PostAsync([this]() {
+        last_partial_.clear();
+        Notify(RECOGNIZER_EVENT_FINAL, FinalResult());
+    });
+}
+
+// Failed tasks are reported with the error event, otherwise the client
+// would wait for a result which never comes. The error is also kept for
+// WaitAsync.
+void Recognizer::PostAsync(std::function<void()> task)
+{
+    strand_->Post([this, task]() {
+        string error;
+        try {
+            task();
+            return;
+        } catch (const std::exception &e) {
+            error = e.what();
+        } catch (...) {
+            error = "unknown error";
+        }
+        KALDI_WARN << "Asynchronous recognition failed: " << error;
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex_);
+            async_failed_ = true;
+        }
+        json::JSON obj;
+        obj["error"] = error;
+        Notify(RECOGNIZER_EVENT_ERROR, obj.dump().c_str());
+    });
+}
+
+bool Recognizer::WaitAsync()
+{
+    if (strand_)
+        strand_->Wait();
+
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    bool failed = async_failed_;
+    async_failed_ = false;
+    return !failed;
+}
+
+// Waits until the worker decoded all queued audio, the decoder can be
+// used from the caller thread after that. With all set the worker doesn't
+// end utterances at endpoints, the rest of the audio goes to the final
+// result.
+void Recognizer::Drain(bool all)
+{
+    if (!pipelined_)
+        return;
+
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    if (all) {
+        drain_all_ = true;
+    }
+    queue_cv_.wait(lock, [this]() {
+        return (queue_.empty() && !worker_busy_) || worker_error_;
+    });
+    if (worker_error_) {
+        KALDI_WARN << "Decoding failed in the worker thread, dropping queued audio";
+        worker_error_ = nullptr;
+        queue_.clear();
+        queue_cv_.wait(lock, [this]() { return !worker_busy_; });
+    }
+    if (all) {
+        drain_all_ = false;
+    }
+}
+
+// Ends the utterance at an endpoint in the worker thread. The lattice and
+// the speaker vector are kept for Result(), the decoder goes on with the
+// next utterance as after a result in non-pipelined mode.
+void Recognizer::EndUtterance(UtteranceResult *result)
+{
+    if (samples_pending_ > 0) {
+        AdvanceDecoding();
+    }
+    decoder_->FinalizeDecoding();
+    if (decoder_->NumFramesDecoded() > 0) {
+        result->clat = decoder_->GetLattice(decoder_->NumFramesDecoded(), true);
+    }
+    result->start_time = samples_round_start_ / sample_frequency_ + frame_offset_ * 0.03;
+    result->has_spk = spk_model_ && GetSpkVector(result->spk, &result->spk_frames);
+    CleanUp();
+}
+
+// Takes the oldest utterance the worker ended at an endpoint
+bool Recognizer::PopResult(UtteranceResult *result)
+{
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (results_.empty())
+        return false;
+    *result = results_.front();
+    results_.pop_front();
+    return true;
+}
+
+const char *Recognizer::QueuedResult(const UtteranceResult &result)
+{
+    if (result.clat.Start() == fst::kNoStateId) {
+        return StoreEmptyReturn();
+    }
+
+    CompactLattice clat = result.clat;
+    const char *res;
+    result_start_time_ = result.start_time;
+    queued_result_ = &result;
+    try {
+        res = LatticeResult(clat);
+    } catch (...) {
+        queued_result_ = nullptr;
+        throw;
+    }
+    queued_result_ = nullptr;
+    return res;
 }
 
 // Computes an xvector from a chunk of speech features.
 static void RunNnetComputation(const MatrixBase<BaseFloat> &features,
-    const nnet3::Nnet &nnet, nnet3::CachingOptimizingCompiler *compiler,
+    const nnet3::Nnet &nnet, const nnet3::NnetComputation &computation,
     Vector<BaseFloat> *xvector) 
 {
-    nnet3::ComputationRequest request;
-    request.need_model_derivative = false;
-    request.store_component_stats = false;
-    request.inputs.push_back(
-    nnet3::IoSpecification("input", 0, features.NumRows()));
-    nnet3::IoSpecification output_spec;
-    output_spec.name = "output";
-    output_spec.has_deriv = false;
-    output_spec.indexes.resize(1);
-    request.outputs.resize(1);
-    request.outputs[0].Swap(&output_spec);
-    shared_ptr<const nnet3::NnetComputation> computation = compiler->Compile(request);
     nnet3::Nnet *nnet_to_update = nullptr;  // we're not doing any update.
-    nnet3::NnetComputer computer(nnet3::NnetComputeOptions(), *computation,
+    nnet3::NnetComputer computer(nnet3::NnetComputeOptions(), computation,
                     nnet, nnet_to_update);
     CuMatrix<BaseFloat> input_feats_cu(features);
     computer.AcceptInput("input", &input_feats_cu);
@@ -449,7 +891,87 @@ static void RunNnetComputation(const MatrixBase<BaseFloat> &features,
 
 #define MIN_SPK_FEATS 50
 
-bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frames)
+// Decoder frames held back in incremental mode until the traceback settles
+#define SPK_DECISION_DELAY 50
+
+// Passes speaker features of the frames which the decoder considers
+// nonsilence to the incremental statistics. Recent frames may still change
+// from silence to speech, they are passed with a delay.
+void Recognizer::UpdateSpkStats(bool final)
+{
+    if (!spk_stats_ || !silence_weighting_->Active() || feature_pipeline_->NumFramesReady() == 0)
+        return;
+
+    int32 num_frames = decoder_->NumFramesDecoded();
+    if (!final)
+        num_frames -= SPK_DECISION_DELAY;
+    if (num_frames <= spk_decided_frames_)
+        return;
+
+    vector<int32> nonsilence_frames;
+    silence_weighting_->ComputeCurrentTraceback(decoder_->Decoder(), true);
+    silence_weighting_->GetNonsilenceFrames(feature_pipeline_->NumFramesReady(),
+                                      frame_offset_ * 3,
+                                      &nonsilence_frames);
+
+    vector<bool> is_nonsilence(num_frames, false);
+    for (int32 frame : nonsilence_frames) {
+       if (frame >= spk_decided_frames_ && frame < num_frames)
+           is_nonsilence[frame] = true;
+    }
+
+    OnlineFeatureInterface *spk_feature = SpkFeature();
+    Vector<BaseFloat> feat(spk_feature->Dim());
+    int32 num_spk_frames = spk_feature->NumFramesReady();
+    for (int32 frame = spk_decided_frames_; frame < num_frames; frame++) {
+       if (!is_nonsilence[frame])
+           continue;
+       for (int32 i = (frame_offset_ + frame) * 3; i < (frame_offset_ + frame + 1) * 3 && i < num_spk_frames; i++) {
+           spk_feature->GetFrame(i, &feat);
+           spk_stats_->AcceptFrame(feat);
+       }
+    }
+    spk_decided_frames_ = num_frames;
+}
+
+bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frames, bool final)
+{
+    Vector<BaseFloat> xvector;
+
+    if (spk_stats_) {
+        if (final) {
+            UpdateSpkStats(true);
+            spk_stats_->Flush();
+        }
+        *num_spk_frames = spk_stats_->NumFrames();
+        if (spk_stats_->NumFrames() < MIN_SPK_FEATS || !spk_stats_->GetXvector(&xvector)) {
+            return false;
+        }
+    } else if (!final) {
+        return false;
+    } else {
+        if (!GetSpkXvector(xvector, num_spk_frames)) {
+            return false;
+        }
+    }
+
+    // Whiten the vector with global mean and transform and normalize mean
+    xvector.AddVec(-1.0, spk_model_->mean);
+
+    out_xvector.Resize(spk_model_->transform.NumRows(), kSetZero);
+    out_xvector.AddMatVec(1.0, spk_model_->transform, kNoTrans, xvector, 0.0);
+
+    BaseFloat norm = out_xvector.Norm(2.0);
+    BaseFloat ratio = norm / sqrt(out_xvector.Dim()); // how much larger it is
+                                                  // than it would be, in
+                                                  // expectation, if normally
+    out_xvector.Scale(1.0 / ratio);
+
+    return true;
+}
+
+// Computes x-vector over all nonsilence frames of the utterance
+bool Recognizer::GetSpkXvector(Vector<BaseFloat> &xvector, int *num_spk_frames)
 {
     vector<int32> nonsilence_frames;
     if (silence_weighting_->Active() && feature_pipeline_->NumFramesReady() > 0) {
@@ -459,20 +981,26 @@ bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frame
                                           &nonsilence_frames);
     }
 
-    int num_frames = spk_feature_->NumFramesReady() - frame_offset_ * 3;
-    Matrix<BaseFloat> mfcc(num_frames, spk_feature_->Dim());
+    OnlineFeatureInterface *spk_feature = SpkFeature();
+    int num_frames = spk_feature->NumFramesReady() - frame_offset_ * 3;
+    Matrix<BaseFloat> mfcc(num_frames, spk_feature->Dim());
+
+    // Nonsilence frames are decoder frames, 3 feature frames each
+    vector<bool> is_nonsilence((num_frames + 2) / 3, false);
+    for (int32 frame : nonsilence_frames) {
+       if (frame >= 0 && frame < static_cast<int32>(is_nonsilence.size()))
+           is_nonsilence[frame] = true;
+    }
 
-    // Not very efficient, would be nice to have faster search
     int num_nonsilence_frames = 0;
-    Vector<BaseFloat> feat(spk_feature_->Dim());
+    Vector<BaseFloat> feat(spk_feature->Dim());
 
     for (int i = 0; i < num_frames; ++i) {
-       if (std::find(nonsilence_frames.begin(),
-                     nonsilence_frames.end(), i / 3) == nonsilence_frames.end()) {
+       if (!is_nonsilence[i / 3]) {
            continue;
        }
 
-       spk_feature_->GetFrame(i + frame_offset_ * 3, &feat);
+       spk_feature->GetFrame(i + frame_offset_ * 3, &feat);
        mfcc.CopyRowFromVec(feat, num_nonsilence_frames);
        num_nonsilence_frames++;
     }
@@ -484,7 +1012,7 @@ bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frame
         return false;
     }
 
-    mfcc.Resize(num_nonsilence_frames, spk_feature_->Dim(), kCopyData);
+    mfcc.Resize(num_nonsilence_frames, spk_feature->Dim(), kCopyData);
 
     SlidingWindowCmnOptions cmvn_opts;
     cmvn_opts.center = true;
@@ -492,30 +1020,22 @@ bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frame
     Matrix<BaseFloat> features(mfcc.NumRows(), mfcc.NumCols(), kUndefined);
     SlidingWindowCmn(cmvn_opts, mfcc, &features);
 
-    nnet3::NnetSimpleComputationOptions opts;
-    nnet3::CachingOptimizingCompilerOptions compiler_config;
-    nnet3::CachingOptimizingCompiler compiler(spk_model_->speaker_nnet, opts.optimize_config, compiler_config);
-
-    Vector<BaseFloat> xvector;
-    RunNnetComputation(features, spk_model_->speaker_nnet, &compiler, &xvector);
-
-    // Whiten the vector with global mean and transform and normalize mean
-    xvector.AddVec(-1.0, spk_model_->mean);
-
-    out_xvector.Resize(spk_model_->transform.NumRows(), kSetZero);
-    out_xvector.AddMatVec(1.0, spk_model_->transform, kNoTrans, xvector, 0.0);
-
-    BaseFloat norm = out_xvector.Norm(2.0);
-    BaseFloat ratio = norm / sqrt(out_xvector.Dim()); // how much larger it is
-                                                  // than it would be, in
-                                                  // expectation, if normally
-    out_xvector.Scale(1.0 / ratio);
+    // With batching the utterance goes through the split network in
+    // chunks, so it can be batched with other recognizers
+    if (spk_model_->frame_batcher_) {
+        OnlineXvectorStats stats(spk_model_);
+        stats.AcceptFeatures(features);
+        stats.Flush();
+        return stats.GetXvector(&xvector);
+    }
 
+    RunNnetComputation(features, spk_model_->speaker_nnet,
+                       *spk_model_->GetComputation(features.NumRows()), &xvector);
     return true;
 }
 
 // If we can't align, we still need to prepare for MBR
-static void CopyLatticeForMbr(CompactLattice &lat, CompactLattice *lat_out)
+static void CopyLatticeForMbr(const CompactLattice &lat, CompactLattice *lat_out)
 {
     *lat_out = lat;
     RmEpsilon(lat_out, true);
@@ -523,6 +1043,82 @@ static void CopyLatticeForMbr(CompactLattice &lat, CompactLattice *lat_out)
     TopSortCompactLatticeIfNeeded(lat_out);
 }
 
+// Finds states which every path of the topologically sorted lattice goes
+// through, no arc jumps over them and no path ends before them. Words before
+// such a state don't depend on the rest of the lattice. With word alignment
+// a cut must also lie inside silence on all its arcs, so the parts on both
+// sides align separately. Returns cut states in order with their frames,
+// the start state is always the first one.
+static void FindLatticeCuts(const CompactLattice &lat, const TransitionModel &trans_model,
+                            const WordBoundaryInfo *winfo,
+                            vector<pair<int32, int32> > *cuts)
+{
+    int32 num_states = lat.NumStates();
+    vector<int32> frames(num_states, -1);
+    vector<bool> silence_in(num_states, true);
+    auto is_silence = [&](int32 tid) {
+        return winfo->TypeOfPhone(trans_model.TransitionIdToPhone(tid)) == WordBoundaryInfo::kNonWordPhone;
+    };
+
+    int32 start = lat.Start(), max_next = start;
+    frames[start] = 0;
+    for (int32 state = start; state < num_states; state++) {
+        if (frames[state] < 0)
+            continue;
+
+        bool is_cut = state == start ||
+            (max_next <= state && lat.Final(state) == CompactLatticeWeight::Zero());
+        bool silence_out = true;
+        for (fst::ArcIterator<CompactLattice> aiter(lat, state); !aiter.Done(); aiter.Next()) {
+            const CompactLatticeArc &arc = aiter.Value();
+            const vector<int32> &tids = arc.weight.String();
+            if (frames[arc.nextstate] < 0)
+                frames[arc.nextstate] = frames[state] + tids.size();
+            max_next = std::max(max_next, arc.nextstate);
+            if (winfo) {
+                silence_out = silence_out && !tids.empty() && is_silence(tids.front());
+                if (tids.empty() || !is_silence(tids.back()))
+                    silence_in[arc.nextstate] = false;
+            }
+        }
+        if (is_cut && (state == start || !winfo || (silence_in[state] && silence_out)))
+            cuts->push_back(make_pair(state, frames[state]));
+
+        // Paths end here, nothing after is on every path
+        if (lat.Final(state) != CompactLatticeWeight::Zero())
+            break;
+    }
+}
+
+// Copies the part of the lattice between two cut states, the end state
+// becomes final. With kNoStateId as the end the part goes to the end of
+// the lattice.
+static void ExtractLatticeSegment(const CompactLattice &lat, int32 begin, int32 end,
+                                  CompactLattice *segment)
+{
+    int32 last = (end == fst::kNoStateId) ? lat.NumStates() - 1 : end;
+    segment->DeleteStates();
+    for (int32 state = begin; state <= last; state++)
+        segment->AddState();
+    segment->SetStart(0);
+    for (int32 state = begin; state <= last; state++) {
+        if (state == end) {
+            segment->SetFinal(state - begin, CompactLatticeWeight::One());
+            continue;
+        }
+        segment->SetFinal(state - begin, lat.Final(state));
+        for (fst::ArcIterator<CompactLattice> aiter(lat, state); !aiter.Done(); aiter.Next()) {
+            CompactLatticeArc arc = aiter.Value();
+            // Only unreachable states have arcs over the cut
+            if (arc.nextstate > last)
+                continue;
+            arc.nextstate -= begin;
+            segment->AddArc(state - begin, arc);
+        }
+    }
+    fst::Connect(segment);
+}
+
 const char *Recognizer::MbrResult(CompactLattice &rlat)
 {
 
@@ -539,220 +1135,204 @@ const char *Recognizer::MbrResult(CompactLattice &rlat)
     const vector<pair<BaseFloat, BaseFloat> > &times =
           mbr.GetOneBestTimes();
 
-    int size = words.size();
-
-    json::JSON obj;
-    stringstream text;
-
-    // Create JSON object
-    for (int i = 0; i < size; i++) {
-        json::JSON word;
-
-        if (words_) {
-            word["word"] = model_->word_syms_->Find(words[i]);
-            word["start"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].first) * 0.03;
-            word["end"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].second) * 0.03;
-            word["conf"] = conf[i];
-            obj["result"].append(word);
-        }
+    ClearResult();
+    result_alternatives_.push_back(ResultAlternative{1.0, 0, words.size()});
+    for (size_t i = 0; i < words.size(); i++) {
+        result_words_.push_back(ResultWord{words[i],
+            result_start_time_ + times[i].first * 0.03,
+            result_start_time_ + times[i].second * 0.03,
+            conf[i]});
+    }
+    FillSpkVector();
 
-        if (i) {
-            text << " ";
-        }
-        text << model_->word_syms_->Find(words[i]);
+    if (struct_result_) {
+        return nullptr;
     }
-    obj["text"] = text.str();
 
-    if (spk_model_) {
-        Vector<BaseFloat> xvector;
-        int num_spk_frames;
-        if (GetSpkVector(xvector, &num_spk_frames)) {
-            for (int i = 0; i < xvector.Dim(); i++) {
-                obj["spk"].append(xvector(i));
-            }
-            obj["spk_frames"] = num_spk_frames;
+    json_.Clear();
+    json_.StartObject();
+
+    if (words_ && result_words_.size() > 0) {
+        json_.Key("result");
+        json_.StartArray();
+        for (const ResultWord &word : result_words_) {
+            json_.StartObject();
+            json_.Key("conf");
+            json_.Float(word.conf);
+            json_.Key("end");
+            json_.Float(word.end);
+            json_.Key("start");
+            json_.Float(word.start);
+            json_.Key("word");
+            json_.String(model_->word_syms_->Find(word.id));
+            json_.EndObject();
         }
+        json_.EndArray();
     }
 
-    return StoreReturn(obj.dump());
-}
+    WriteSpkVector();
 
-static bool CompactLatticeToWordAlignmentWeight(const CompactLattice &clat,
-                                                std::vector<int32> *words,
-                                                std::vector<int32> *begin_times,
-                                                std::vector<int32> *lengths,
-                                                CompactLattice::Weight *tot_weight_out)
-{
-  typedef CompactLattice::Arc Arc;
-  typedef Arc::Label Label;
-  typedef CompactLattice::StateId StateId;
-  typedef CompactLattice::Weight Weight;
-  using namespace fst;
-
-  words->clear();
-  begin_times->clear();
-  lengths->clear();
-  *tot_weight_out = Weight::Zero();
+    json_.Key("text");
+    json_.String(ResultText(result_alternatives_[0]));
+    json_.EndObject();
 
-  StateId state = clat.Start();
-  Weight tot_weight = Weight::One();
+    return StoreJsonReturn();
+}
 
-  int32 cur_time = 0;
-  if (state == kNoStateId) {
-    KALDI_WARN << "Empty lattice.";
-    return false;
-  }
-  while (1) {
-    Weight final = clat.Final(state);
-    size_t num_arcs = clat.NumArcs(state);
-    if (final != Weight::Zero()) {
-      if (num_arcs != 0) {
-        KALDI_WARN << "Lattice is not linear.";
-        return false;
-      }
-      if (!final.String().empty()) {
-        KALDI_WARN << "Lattice has alignments on final-weight: probably "
-            "was not word-aligned (alignments will be approximate)";
-      }
-      tot_weight = Times(final, tot_weight);
-      *tot_weight_out = tot_weight;
-      return true;
+struct NbestPath {
+    vector<int32> words;
+    vector<int32> begin_times;
+    vector<int32> lengths;
+    float likelihood;
+};
+
+// Returns up to n best paths with word times. The lattice is word-aligned
+// once instead of every path separately. Each arc of the aligned lattice
+// gets its own label, so the paths found in the expanded lattice can be
+// cut back into words with their frames.
+static void GetAlignedNbest(const CompactLattice &clat, const TransitionModel &trans_model,
+                            const WordBoundaryInfo *winfo, int32 n, vector<NbestPath> *nbest)
+{
+    CompactLattice aligned_lat;
+    if (winfo) {
+        WordAlignLattice(clat, trans_model, *winfo, 0, &aligned_lat);
     } else {
-      if (num_arcs != 1) {
-        KALDI_WARN << "Lattice is not linear: num-arcs = " << num_arcs;
-        return false;
-      }
-      fst::ArcIterator<CompactLattice> aiter(clat, state);
-      const Arc &arc = aiter.Value();
-      Label word_id = arc.ilabel; // Note: ilabel==olabel, since acceptor.
-      // Also note: word_id may be zero; we output it anyway.
-      int32 length = arc.weight.String().size();
-      words->push_back(word_id);
-      begin_times->push_back(cur_time);
-      lengths->push_back(length);
-      tot_weight = Times(arc.weight, tot_weight);
-      cur_time += length;
-      state = arc.nextstate;
+        aligned_lat = clat;
     }
-  }
-}
 
+    // Word and number of frames for each arc label, label 0 is epsilon
+    vector<pair<int32, int32> > arc_words(1, make_pair(0, 0));
+    for (fst::StateIterator<CompactLattice> siter(aligned_lat); !siter.Done(); siter.Next()) {
+        for (fst::MutableArcIterator<CompactLattice> aiter(&aligned_lat, siter.Value());
+             !aiter.Done(); aiter.Next()) {
+            CompactLatticeArc arc = aiter.Value();
+            arc_words.push_back(make_pair(arc.olabel, static_cast<int32>(arc.weight.String().size())));
+            arc.ilabel = arc.olabel = arc_words.size() - 1;
+            aiter.SetValue(arc);
+        }
+    }
 
-const char *Recognizer::NbestResult(CompactLattice &clat)
-{
     Lattice lat;
     Lattice nbest_lat;
-    std::vector<Lattice> nbest_lats;
-
-    ConvertLattice (clat, &lat);
-    fst::ShortestPath(lat, &nbest_lat, max_alternatives_);
+    vector<Lattice> nbest_lats;
+    ConvertLattice(aligned_lat, &lat);
+    fst::ShortestPath(lat, &nbest_lat, n);
     fst::ConvertNbestToVector(nbest_lat, &nbest_lats);
 
-    json::JSON obj;
-    for (int k = 0; k < nbest_lats.size(); k++) {
-
-      Lattice nlat = nbest_lats[k];
-
-      CompactLattice nclat;
-      fst::Invert(&nlat);
-      DeterminizeLattice(nlat, &nclat);
-
-      CompactLattice aligned_nclat;
-      if (model_->winfo_) {
-          WordAlignLattice(nclat, *model_->trans_model_, *model_->winfo_, 0, &aligned_nclat);
-      } else {
-          aligned_nclat = nclat;
-      }
-
-      std::vector<int32> words;
-      std::vector<int32> begin_times;
-      std::vector<int32> lengths;
-      CompactLattice::Weight weight;
-
-      CompactLatticeToWordAlignmentWeight(aligned_nclat, &words, &begin_times, &lengths, &weight);
-      float likelihood = -(weight.Weight().Value1() + weight.Weight().Value2());
-
-      stringstream text;
-      json::JSON entry;
-
-      for (int i = 0, first = 1; i < words.size(); i++) {
-        json::JSON word;
-        if (words[i] == 0)
-            continue;
-        if (words_) {
-            word["word"] = model_->word_syms_->Find(words[i]);
-            word["start"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + begin_times[i]) * 0.03;
-            word["end"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + begin_times[i] + lengths[i]) * 0.03;
-            entry["result"].append(word);
+    nbest->resize(nbest_lats.size());
+    for (size_t k = 0; k < nbest_lats.size(); k++) {
+        const Lattice &path_lat = nbest_lats[k];
+        NbestPath &path = (*nbest)[k];
+        LatticeWeight weight = LatticeWeight::One();
+        int32 frame = 0;
+
+        // Paths are linear, arc labels are on the first arc of each
+        // expanded aligned arc
+        Lattice::StateId state = path_lat.Start();
+        while (state != fst::kNoStateId && path_lat.NumArcs(state) > 0) {
+            fst::ArcIterator<Lattice> aiter(path_lat, state);
+            const LatticeArc &arc = aiter.Value();
+            weight = Times(weight, arc.weight);
+            if (arc.olabel != 0) {
+                const pair<int32, int32> &word = arc_words[arc.olabel];
+                path.words.push_back(word.first);
+                path.begin_times.push_back(frame);
+                path.lengths.push_back(word.second);
+                frame += word.second;
+            }
+            state = arc.nextstate;
+        }
+        if (state != fst::kNoStateId) {
+            weight = Times(weight, path_lat.Final(state));
         }
+        path.likelihood = -(weight.Value1() + weight.Value2());
+    }
+}
 
-        if (first)
-          first = 0;
-        else
-          text << " ";
 
-        text << model_->word_syms_->Find(words[i]);
+const char *Recognizer::NbestResult(CompactLattice &clat)
+{
+    vector<NbestPath> nbest;
+    GetAlignedNbest(clat, *model_->trans_model_, model_->winfo_, max_alternatives_, &nbest);
+
+    ClearResult();
+    result_nbest_ = true;
+    for (const NbestPath &path : nbest) {
+      size_t first_word = result_words_.size();
+      for (size_t i = 0; i < path.words.size(); i++) {
+        if (path.words[i] == 0)
+            continue;
+        result_words_.push_back(ResultWord{path.words[i],
+            result_start_time_ + path.begin_times[i] * 0.03,
+            result_start_time_ + (path.begin_times[i] + path.lengths[i]) * 0.03,
+            0.0});
       }
+      result_alternatives_.push_back(ResultAlternative{path.likelihood, first_word, result_words_.size()});
+    }
+    FillSpkVector();
 
-      entry["text"] = text.str();
-      entry["confidence"]= likelihood;
-      obj["alternatives"].append(entry);
+    if (struct_result_) {
+        return nullptr;
     }
 
-    if (spk_model_) {
-        Vector<BaseFloat> xvector;
-        int num_spk_frames;
-        if (GetSpkVector(xvector, &num_spk_frames)) {
-            for (int i = 0; i < xvector.Dim(); i++) {
-                obj["spk"].append(xvector(i));
+    // Nothing to write, json::JSON dumps it as null
+    if (result_alternatives_.empty() && !result_has_spk_) {
+        return StoreReturn("null");
+    }
+
+    json_.Clear();
+    json_.StartObject();
+
+    if (!result_alternatives_.empty()) {
+        json_.Key("alternatives");
+        json_.StartArray();
+        for (const ResultAlternative &alternative : result_alternatives_) {
+            json_.StartObject();
+            json_.Key("confidence");
+            json_.Float(alternative.confidence);
+            if (words_ && alternative.word_end > alternative.word_begin) {
+                json_.Key("result");
+                json_.StartArray();
+                for (size_t i = alternative.word_begin; i < alternative.word_end; i++) {
+                    const ResultWord &word = result_words_[i];
+                    json_.StartObject();
+                    json_.Key("end");
+                    json_.Float(word.end);
+                    json_.Key("start");
+                    json_.Float(word.start);
+                    json_.Key("word");
+                    json_.String(model_->word_syms_->Find(word.id));
+                    json_.EndObject();
+                }
+                json_.EndArray();
             }
-            obj["spk_frames"] = num_spk_frames;
+            json_.Key("text");
+            json_.String(ResultText(alternative));
+            json_.EndObject();
         }
+        json_.EndArray();
     }
 
-    return StoreReturn(obj.dump());
+    WriteSpkVector();
+
+    json_.EndObject();
+
+    return StoreJsonReturn();
 }
 
 const char *Recognizer::NlsmlResult(CompactLattice &clat)
 {
-    Lattice lat;
-    Lattice nbest_lat;
-    std::vector<Lattice> nbest_lats;
-
-    ConvertLattice (clat, &lat);
-    fst::ShortestPath(lat, &nbest_lat, max_alternatives_);
-    fst::ConvertNbestToVector(nbest_lat, &nbest_lats);
+    vector<NbestPath> nbest;
+    GetAlignedNbest(clat, *model_->trans_model_, model_->winfo_, max_alternatives_, &nbest);
 
     std::stringstream ss;
     ss << "<?xml version=\"1.0\"?>\n";
     ss << "<result grammar=\"default\">\n";
 
-    for (int k = 0; k < nbest_lats.size(); k++) {
-
-      Lattice nlat = nbest_lats[k];
-
-      CompactLattice nclat;
-      fst::Invert(&nlat);
-      DeterminizeLattice(nlat, &nclat);
-
-      CompactLattice aligned_nclat;
-      if (model_->winfo_) {
-          WordAlignLattice(nclat, *model_->trans_model_, *model_->winfo_, 0, &aligned_nclat);
-      } else {
-          aligned_nclat = nclat;
-      }
-
-      std::vector<int32> words;
-      std::vector<int32> begin_times;
-      std::vector<int32> lengths;
-      CompactLattice::Weight weight;
-
-      CompactLatticeToWordAlignmentWeight(aligned_nclat, &words, &begin_times, &lengths, &weight);
-      float likelihood = -(weight.Weight().Value1() + weight.Weight().Value2());
-
+    for (const NbestPath &path : nbest) {
       stringstream text;
-      for (int i = 0, first = 1; i < words.size(); i++) {
-        if (words[i] == 0)
+      for (int i = 0, first = 1; i < path.words.size(); i++) {
+        if (path.words[i] == 0)
             continue;
 
         if (first)
@@ -760,10 +1340,10 @@ const char *Recognizer::NlsmlResult(CompactLattice &clat)
         else
           text << " ";
 
-        text << model_->word_syms_->Find(words[i]);
+        text << model_->word_syms_->Find(path.words[i]);
       }
 
-      ss << "<interpretation grammar=\"default\" confidence=\"" << likelihood << "\">\n";
+      ss << "<interpretation grammar=\"default\" confidence=\"" << path.likelihood << "\">\n";
       ss << "<input mode=\"speech\">" << text.str() << "</input>\n";
       ss << "<instance>" << text.str() << "</instance>\n";
       ss << "</interpretation>\n";
@@ -775,14 +1355,49 @@ const char *Recognizer::NlsmlResult(CompactLattice &clat)
 
 const char* Recognizer::GetResult()
 {
-    if (decoder_->NumFramesDecoded() == 0) {
+    // Utterances the worker ended at endpoints which were not taken are
+    // joined with this one, as an ignored endpoint continues the utterance
+    // in non-pipelined mode
+    CompactLattice clat;
+    double start_time = samples_round_start_ / sample_frequency_ + frame_offset_ * 0.03;
+    UtteranceResult result;
+    while (PopResult(&result)) {
+        if (result.clat.Start() == fst::kNoStateId)
+            continue;
+        if (clat.Start() == fst::kNoStateId) {
+            clat = result.clat;
+            start_time = result.start_time;
+        } else {
+            fst::Concat(&clat, result.clat);
+        }
+    }
+
+    if (decoder_->NumFramesDecoded() > 0) {
+        CompactLattice dlat = decoder_->GetLattice(decoder_->NumFramesDecoded(), true);
+        if (clat.Start() == fst::kNoStateId) {
+            clat = dlat;
+        } else {
+            fst::Concat(&clat, dlat);
+        }
+    }
+
+    if (clat.Start() == fst::kNoStateId) {
         return StoreEmptyReturn();
     }
 
+    result_start_time_ = start_time;
+    return LatticeResult(clat);
+}
+
+// Rescores the lattice of the utterance and stores the result
+const char *Recognizer::LatticeResult(CompactLattice &clat)
+{
     // Original from decoder, subtracted graph weight, rescored with carpa, rescored with rnnlm
-    CompactLattice clat, slat, tlat, rlat;
+    CompactLattice slat, tlat, rlat;
 
-    clat = decoder_->GetLattice(decoder_->NumFramesDecoded(), true);
+    if (!rescoring_initialized_) {
+        InitRescoring();
+    }
 
     if (lm_to_subtract_ && carpa_to_add_) {
         Lattice lat, composed_lat;
@@ -827,7 +1442,7 @@ const char* Recognizer::GetResult()
 
     if (max_alternatives_ == 0) {
         return MbrResult(rlat);
-    } else if (nlsml_) {
+    } else if (nlsml_ && !struct_result_) {
         return NlsmlResult(rlat);
     } else {
         return NbestResult(rlat);
@@ -842,74 +1457,168 @@ const char* Recognizer::PartialResult()
         return StoreEmptyReturn();
     }
 
-    json::JSON res;
+    Drain();
 
-    if (partial_words_) {
+    if (samples_pending_ > 0) {
+        AdvanceDecoding();
+    }
 
-        if (decoder_->NumFramesInLattice() == 0) {
-            res["partial"] = "";
-            return StoreReturn(res.dump());
-        }
+    if (partial_words_) {
+        return PartialWordsResult();
+    }
 
-        CompactLattice clat;
-        CompactLattice aligned_lat;
+    ClearResult();
+    if (decoder_->NumFramesDecoded() > 0) {
+        Lattice lat;
+        decoder_->GetBestPath(false, &lat);
+        vector<kaldi::int32> alignment, words;
+        LatticeWeight weight;
+        GetLinearSymbolSequence(lat, &alignment, &words, &weight);
 
-        clat = decoder_->GetLattice(decoder_->NumFramesInLattice(), false);
-        if (model_->winfo_) {
-            WordAlignLatticePartial(clat, *model_->trans_model_, *model_->winfo_, 0, &aligned_lat);
-        } else {
-            CopyLatticeForMbr(clat, &aligned_lat);
+        for (size_t i = 0; i < words.size(); i++) {
+            result_words_.push_back(ResultWord{words[i], 0.0, 0.0, 0.0});
         }
+    }
+    result_alternatives_.push_back(ResultAlternative{1.0, 0, result_words_.size()});
+    FillPartialSpkVector();
 
-        MinimumBayesRisk mbr(aligned_lat);
-        const vector<BaseFloat> &conf = mbr.GetOneBestConfidences();
-        const vector<int32> &words = mbr.GetOneBest();
-        const vector<pair<BaseFloat, BaseFloat> > &times = mbr.GetOneBestTimes();
+    return StorePartialReturn();
+}
 
-        int size = words.size();
+// Runs MBR on a part of the lattice and appends its words, times are
+// shifted by the frame the part starts at
+void Recognizer::MbrWords(const CompactLattice &lat, int32 offset, vector<int32> *words,
+                          vector<pair<BaseFloat, BaseFloat> > *times, vector<BaseFloat> *conf)
+{
+    CompactLattice aligned_lat;
+    if (model_->winfo_) {
+        WordAlignLatticePartial(lat, *model_->trans_model_, *model_->winfo_, 0, &aligned_lat);
+    } else {
+        CopyLatticeForMbr(lat, &aligned_lat);
+    }
+    if (aligned_lat.Start() == fst::kNoStateId)
+        return;
 
-        stringstream text;
+    MinimumBayesRisk mbr(aligned_lat);
+    const vector<BaseFloat> &mbr_conf = mbr.GetOneBestConfidences();
+    const vector<int32> &mbr_words = mbr.GetOneBest();
+    const vector<pair<BaseFloat, BaseFloat> > &mbr_times = mbr.GetOneBestTimes();
+    for (size_t i = 0; i < mbr_words.size(); i++) {
+        words->push_back(mbr_words[i]);
+        times->push_back(make_pair(offset + mbr_times[i].first, offset + mbr_times[i].second));
+        conf->push_back(mbr_conf[i]);
+    }
+}
 
-        // Create JSON object
-        for (int i = 0; i < size; i++) {
-            json::JSON word;
+void Recognizer::ClearPartialWords()
+{
+    partial_frames_ = -1;
+    stable_frames_ = 0;
+    stable_words_.clear();
+    stable_times_.clear();
+    stable_conf_.clear();
+}
 
-            word["word"] = model_->word_syms_->Find(words[i]);
-            word["start"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].first) * 0.03;
-            word["end"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].second) * 0.03;
-            word["conf"] = conf[i];
-            res["partial_result"].append(word);
+// Partial result with word times and confidences. The result is kept until
+// new frames appear in the lattice. Words before the last state which every
+// path goes through can't change anymore, they are computed once and kept,
+// so MBR runs only on the lattice after that state and the cost doesn't
+// grow with the utterance length.
+const char *Recognizer::PartialWordsResult()
+{
+    int32 num_frames = decoder_->NumFramesInLattice();
+    if (num_frames == partial_frames_) {
+        return StorePartialReturn();
+    }
 
-            if (i) {
-                text << " ";
-            }
-            text << model_->word_syms_->Find(words[i]);
+    ClearResult();
+    if (num_frames > 0) {
+        // The incremental decoder keeps the lattice determinized so far,
+        // it is used in place
+        const CompactLattice *clat = &decoder_->GetLattice(num_frames, false);
+        CompactLattice sorted_lat;
+        if (clat->Properties(fst::kTopSorted, true) == 0) {
+            sorted_lat = *clat;
+            TopSortCompactLatticeIfNeeded(&sorted_lat);
+            clat = &sorted_lat;
         }
-        res["partial"] = text.str();
 
-    } else {
+        vector<pair<int32, int32> > cuts;
+        FindLatticeCuts(*clat, *model_->trans_model_, model_->winfo_, &cuts);
 
-        if (decoder_->NumFramesDecoded() == 0) {
-            res["partial"] = "";
-            return StoreReturn(res.dump());
+        // The stable words end at a cut, if the lattice was rebuilt
+        // and it's not there anymore they are computed again
+        int32 begin = fst::kNoStateId;
+        for (const pair<int32, int32> &cut : cuts) {
+            if (cut.second == stable_frames_)
+                begin = cut.first;
         }
-        Lattice lat;
-        decoder_->GetBestPath(false, &lat);
-        vector<kaldi::int32> alignment, words;
-        LatticeWeight weight;
-        GetLinearSymbolSequence(lat, &alignment, &words, &weight);
+        if (begin == fst::kNoStateId) {
+            ClearPartialWords();
+            begin = cuts[0].first;
+        }
+
+        CompactLattice segment;
+        if (cuts.back().second > stable_frames_) {
+            ExtractLatticeSegment(*clat, begin, cuts.back().first, &segment);
+            MbrWords(segment, stable_frames_, &stable_words_, &stable_times_, &stable_conf_);
+            begin = cuts.back().first;
+            stable_frames_ = cuts.back().second;
+        }
+
+        vector<int32> words = stable_words_;
+        vector<pair<BaseFloat, BaseFloat> > times = stable_times_;
+        vector<BaseFloat> conf = stable_conf_;
+        ExtractLatticeSegment(*clat, begin, fst::kNoStateId, &segment);
+        MbrWords(segment, stable_frames_, &words, &times, &conf);
 
-        ostringstream text;
         for (size_t i = 0; i < words.size(); i++) {
-            if (i) {
-                text << " ";
-            }
-            text << model_->word_syms_->Find(words[i]);
+            result_words_.push_back(ResultWord{words[i],
+                samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].first) * 0.03,
+                samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].second) * 0.03,
+                conf[i]});
         }
-        res["partial"] = text.str();
     }
+    result_alternatives_.push_back(ResultAlternative{1.0, 0, result_words_.size()});
+    FillPartialSpkVector();
 
-    return StoreReturn(res.dump());
+    partial_frames_ = num_frames;
+    return StorePartialReturn();
+}
+
+// Partial result is kept in the structured form, so it can be returned again
+// in any format while the lattice doesn't change
+const char *Recognizer::StorePartialReturn()
+{
+    if (struct_result_) {
+        return nullptr;
+    }
+
+    json_.Clear();
+    json_.StartObject();
+    json_.Key("partial");
+    json_.String(ResultText(result_alternatives_[0]));
+    if (partial_words_ && result_words_.size() > 0) {
+        json_.Key("partial_result");
+        json_.StartArray();
+        for (const ResultWord &word : result_words_) {
+            json_.StartObject();
+            json_.Key("conf");
+            json_.Float(word.conf);
+            json_.Key("end");
+            json_.Float(word.end);
+            json_.Key("start");
+            json_.Float(word.start);
+            json_.Key("word");
+            json_.String(model_->word_syms_->Find(word.id));
+            json_.EndObject();
+        }
+        json_.EndArray();
+    }
+    WriteSpkVector();
+    json_.EndObject();
+
+    return StoreJsonReturn();
 }
 
 const char* Recognizer::Result()
@@ -917,6 +1626,21 @@ const char* Recognizer::Result()
     if (state_ != RECOGNIZER_RUNNING) {
         return StoreEmptyReturn();
     }
+
+    // In pipelined mode the worker already ended the utterance, an
+    // endpoint may also be found in the audio still queued
+    UtteranceResult result;
+    if (PopResult(&result)) {
+        return QueuedResult(result);
+    }
+    Drain();
+    if (PopResult(&result)) {
+        return QueuedResult(result);
+    }
+
+    if (samples_pending_ > 0) {
+        AdvanceDecoding();
+    }
     decoder_->FinalizeDecoding();
     state_ = RECOGNIZER_ENDPOINT;
     return GetResult();
@@ -928,9 +1652,9 @@ const char* Recognizer::FinalResult()
         return StoreEmptyReturn();
     }
 
+    Drain(true);
     feature_pipeline_->InputFinished();
-    UpdateSilenceWeights();
-    decoder_->AdvanceDecoding();
+    AdvanceDecoding();
     decoder_->FinalizeDecoding();
     state_ = RECOGNIZER_FINALIZED;
     GetResult();
@@ -950,17 +1674,55 @@ const char* Recognizer::FinalResult()
     return last_result_.c_str();
 }
 
+// Runs the regular result method without serializing the result and
+// returns it in the structured form
+const VoskResult *Recognizer::StructResult(const char *(Recognizer::*result)())
+{
+    struct_result_ = true;
+    try {
+        (this->*result)();
+    } catch (...) {
+        struct_result_ = false;
+        throw;
+    }
+    struct_result_ = false;
+    return StoreStructReturn();
+}
+
+const VoskResult *Recognizer::ResultStruct()
+{
+    return StructResult(&Recognizer::Result);
+}
+
+const VoskResult *Recognizer::PartialResultStruct()
+{
+    return StructResult(&Recognizer::PartialResult);
+}
+
+const VoskResult *Recognizer::FinalResultStruct()
+{
+    return StructResult(&Recognizer::FinalResult);
+}
+
 void Recognizer::Reset()
 {
+    Drain();
+    {
+        // Utterances ended by the pipelined worker are dropped too
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        results_.clear();
+    }
     if (state_ == RECOGNIZER_RUNNING) {
         decoder_->FinalizeDecoding();
     }
+    samples_pending_ = 0;
     StoreEmptyReturn();
     state_ = RECOGNIZER_ENDPOINT;
 }
 
 const char *Recognizer::StoreEmptyReturn()
 {
+    ClearResult();
     if (!max_alternatives_) {
         return StoreReturn("{\"text\": \"\"}");
     } else if (nlsml_) {
@@ -982,3 +1744,122 @@ const char *Recognizer::StoreReturn(const string &res)
     last_result_ = res;
     return last_result_.c_str();
 }
+
+// Moves the written result into the recognizer, the old result buffer
+// goes back to the writer to be reused
+const char *Recognizer::StoreJsonReturn()
+{
+    last_result_.swap(json_.Buffer());
+    return last_result_.c_str();
+}
+
+void Recognizer::FillSpkVector()
+{
+    if (queued_result_) {
+        result_has_spk_ = queued_result_->has_spk;
+        result_spk_ = queued_result_->spk;
+        result_spk_frames_ = queued_result_->spk_frames;
+        return;
+    }
+    result_has_spk_ = spk_model_ && GetSpkVector(result_spk_, &result_spk_frames_);
+}
+
+// Partial speaker vector from the statistics collected so far, only in
+// incremental mode
+void Recognizer::FillPartialSpkVector()
+{
+    result_has_spk_ = spk_stats_ && partial_spk_ && GetSpkVector(result_spk_, &result_spk_frames_, false);
+}
+
+void Recognizer::WriteSpkVector()
+{
+    if (!result_has_spk_)
+        return;
+
+    json_.Key("spk");
+    json_.StartArray();
+    for (int i = 0; i < result_spk_.Dim(); i++) {
+        json_.Float(result_spk_(i));
+    }
+    json_.EndArray();
+    json_.Key("spk_frames");
+    json_.Int(result_spk_frames_);
+}
+
+void Recognizer::ClearResult()
+{
+    result_words_.clear();
+    result_alternatives_.clear();
+    result_has_spk_ = false;
+    result_nbest_ = false;
+}
+
+const string &Recognizer::ResultText(const ResultAlternative &alternative)
+{
+    text_.clear();
+    for (size_t i = alternative.word_begin; i < alternative.word_end; i++) {
+        if (i > alternative.word_begin) {
+            text_ += " ";
+        }
+        text_ += model_->word_syms_->Find(result_words_[i].id);
+    }
+    return text_;
+}
+
+// Exposes the structured result through the C structures, strings are
+// packed into a single buffer and pointers are set once it is complete
+const VoskResult *Recognizer::StoreStructReturn()
+{
+    struct_strings_.clear();
+    vector<size_t> word_offsets, text_offsets;
+
+    c_words_.resize(result_words_.size());
+    for (size_t i = 0; i < result_words_.size(); i++) {
+        const ResultWord &word = result_words_[i];
+        word_offsets.push_back(struct_strings_.size());
+        struct_strings_ += model_->word_syms_->Find(word.id);
+        struct_strings_ += '\0';
+        c_words_[i].id = word.id;
+        c_words_[i].start = word.start;
+        c_words_[i].end = word.end;
+        c_words_[i].conf = word.conf;
+    }
+
+    c_alternatives_.resize(result_alternatives_.size());
+    for (size_t i = 0; i < result_alternatives_.size(); i++) {
+        const ResultAlternative &alternative = result_alternatives_[i];
+        text_offsets.push_back(struct_strings_.size());
+        struct_strings_ += ResultText(alternative);
+        struct_strings_ += '\0';
+        c_alternatives_[i].confidence = alternative.confidence;
+        c_alternatives_[i].num_words = alternative.word_end - alternative.word_begin;
+        c_alternatives_[i].words = c_words_.data() + alternative.word_begin;
+    }
+    struct_strings_ += '\0';
+
+    const char *strings = struct_strings_.c_str();
+    for (size_t i = 0; i < c_words_.size(); i++) {
+        c_words_[i].word = strings + word_offsets[i];
+    }
+    for (size_t i = 0; i < c_alternatives_.size(); i++) {
+        c_alternatives_[i].text = strings + text_offsets[i];
+    }
+
+    c_result_ = VoskResult();
+    c_result_.text = strings + struct_strings_.size() - 1;
+    if (!c_alternatives_.empty()) {
+        c_result_.text = c_alternatives_[0].text;
+        c_result_.num_words = c_alternatives_[0].num_words;
+        c_result_.words = c_alternatives_[0].words;
+    }
+    if (result_nbest_) {
+        c_result_.num_alternatives = c_alternatives_.size();
+        c_result_.alternatives = c_alternatives_.data();
+    }
+    if (result_has_spk_) {
+        c_result_.spk_dim = result_spk_.Dim();
+        c_result_.spk = result_spk_.Data();
+        c_result_.spk_frames = result_spk_frames_;
+    }
+    return &c_result_;
+}
@@ -30,9 +30,26 @@
 
 #include "model.h"
 #include "spk_model.h"
+#include "json_writer.h"
+#include "vosk_api.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 using namespace kaldi;
 
+enum RecognizerEvent {
+    RECOGNIZER_EVENT_PARTIAL,
+    RECOGNIZER_EVENT_RESULT,
+    RECOGNIZER_EVENT_FINAL,
+    RECOGNIZER_EVENT_ERROR
+};
+
+typedef void (*RecognizerCallback)(void *user_data, int event, const char *json);
+
 enum RecognizerState {
     RECOGNIZER_INITIALIZED,
     RECOGNIZER_RUNNING,
@@ -48,18 +65,32 @@ class Recognizer {
         ~Recognizer();
         void SetMaxAlternatives(int max_alternatives);
         void SetSpkModel(SpkModel *spk_model);
+        void SetSpkIncremental(bool incremental);
+        void SetPartialSpk(bool partial_spk);
         void SetGrm(char const *grammar);
         void SetWords(bool words);
         void SetPartialWords(bool partial_words);
         void SetNLSML(bool nlsml);
         void SetEndpointerMode(int mode);
         void SetEndpointerDelays(float t_start_max, float t_end, float t_max);
+        void SetDecodeStep(float step);
+        void SetLatencyTarget(float latency);
+        float GetRtf();
+        void SetPipelined(bool pipelined);
+        void SetCallback(RecognizerCallback callback, void *user_data);
+        void AcceptWaveformAsync(const char *data, int len);
+        void FinishAsync();
+        // Returns false if a task failed since the last wait
+        bool WaitAsync();
         bool AcceptWaveform(const char *data, int len);
         bool AcceptWaveform(const short *sdata, int len);
         bool AcceptWaveform(const float *fdata, int len);
         const char* Result();
         const char* FinalResult();
         const char* PartialResult();
+        const VoskResult *ResultStruct();
+        const VoskResult *FinalResultStruct();
+        const VoskResult *PartialResultStruct();
         void Reset();
 
     private:
@@ -67,12 +98,43 @@ class Recognizer {
         void InitRescoring();
         void CleanUp();
         void UpdateSilenceWeights();
+        void AdvanceDecoding();
+        float DecodeStep();
         void UpdateGrammarFst(char const *grammar);
-        bool AcceptWaveform(Vector<BaseFloat> &wdata);
-        bool GetSpkVector(Vector<BaseFloat> &out_xvector, int *frames);
+        bool AcceptWaveform(const VectorBase<BaseFloat> &wdata);
+        void DecodeWaveform(const VectorBase<BaseFloat> &wdata);
+        bool PushWaveform(const VectorBase<BaseFloat> &wdata);
+        void WorkerLoop();
+        void Drain(bool all = false);
+        struct UtteranceResult;
+        void EndUtterance(UtteranceResult *result);
+        bool PopResult(UtteranceResult *result);
+        const char *QueuedResult(const UtteranceResult &result);
+        void Notify(int event, const char *json);
+        bool HasCallback();
+        void PostAsync(std::function<void()> task);
+        void InitSpkFeature();
+        OnlineFeatureInterface *SpkFeature();
+        void InitSpkStats();
+        void UpdateSpkStats(bool final);
+        bool GetSpkVector(Vector<BaseFloat> &out_xvector, int *frames, bool final = true);
+        bool GetSpkXvector(Vector<BaseFloat> &xvector, int *frames);
         const char *GetResult();
+        const char *LatticeResult(CompactLattice &clat);
         const char *StoreEmptyReturn();
         const char *StoreReturn(const string &res);
+        const char *StoreJsonReturn();
+        const char *StorePartialReturn();
+        const VoskResult *StoreStructReturn();
+        const VoskResult *StructResult(const char *(Recognizer::*result)());
+        void FillSpkVector();
+        void FillPartialSpkVector();
+        void WriteSpkVector();
+        void ClearResult();
+        const char *PartialWordsResult();
+        void MbrWords(const CompactLattice &lat, int32 offset, vector<int32> *words,
+                      vector<pair<BaseFloat, BaseFloat> > *times, vector<BaseFloat> *conf);
+        void ClearPartialWords();
         const char *MbrResult(CompactLattice &clat);
         const char *NbestResult(CompactLattice &clat);
         const char *NlsmlResult(CompactLattice &clat);
@@ -88,16 +150,24 @@ class Recognizer {
 
         // Speaker identification
         SpkModel *spk_model_ = nullptr;
+        // Separate speaker features, null if they are shared with the
+        // feature pipeline
         OnlineBaseFeature *spk_feature_ = nullptr;
+        // Incremental mode, statistics are updated as decoding goes
+        OnlineXvectorStats *spk_stats_ = nullptr;
+        bool spk_incremental_ = false;
+        bool partial_spk_ = false;
+        // Decoder frames of the utterance passed to the statistics
+        int32 spk_decided_frames_ = 0;
 
         // Rescoring
-        fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> > *lm_to_subtract_ = nullptr;
+        LatticeLmFst *lm_to_subtract_ = nullptr;
         kaldi::ConstArpaLmDeterministicFst *carpa_to_add_ = nullptr;
         fst::ScaleDeterministicOnDemandFst *carpa_to_add_scale_ = nullptr;
         // RNNLM rescoring
-        kaldi::rnnlm::KaldiRnnlmDeterministicFst* rnnlm_to_add_ = nullptr;
+        CachedRnnlmFst *rnnlm_to_add_ = nullptr;
         fst::DeterministicOnDemandFst<fst::StdArc> *rnnlm_to_add_scale_ = nullptr;
-        kaldi::rnnlm::RnnlmComputeStateInfo *rnnlm_info_ = nullptr;
+        bool rescoring_initialized_ = false;
 
 
         // Other
@@ -106,6 +176,62 @@ class Recognizer {
         bool partial_words_ = false;
         bool nlsml_ = false;
 
+        // Number of frames the last partial result was computed on
+        int32 partial_frames_ = -1;
+        // Partial words before the last lattice state all paths go
+        // through, they don't change until the end of utterance
+        int32 stable_frames_ = 0;
+        vector<int32> stable_words_;
+        vector<pair<BaseFloat, BaseFloat> > stable_times_;
+        vector<BaseFloat> stable_conf_;
+
+        // Decoding step in seconds, adaptive if latency target is set
+        float decode_step_ = 0.2;
+        float latency_target_ = 0;
+        int64 samples_pending_ = 0;
+        double decode_time_ = 0;
+        double audio_time_ = 0;
+
+        // Pipelined mode, decoding runs in the worker thread
+        static const size_t kMaxQueuedChunks = 4;
+        bool pipelined_ = false;
+        std::thread worker_;
+        std::mutex queue_mutex_;
+        std::condition_variable queue_cv_;
+        std::deque<Vector<BaseFloat> > queue_;
+        std::vector<Vector<BaseFloat> > free_chunks_;
+        bool worker_busy_ = false;
+        bool stop_worker_ = false;
+        // The worker doesn't end utterances at endpoints while the final
+        // result waits for it
+        bool drain_all_ = false;
+        std::exception_ptr worker_error_;
+
+        // Utterance the worker ended at an endpoint, decoding goes on
+        // while the result waits in the queue
+        struct UtteranceResult {
+            // Empty if no frames were decoded
+            CompactLattice clat;
+            // Start of the utterance in seconds
+            double start_time = 0;
+            bool has_spk = false;
+            Vector<BaseFloat> spk;
+            int spk_frames = 0;
+        };
+        std::deque<UtteranceResult> results_;
+        // Result being formatted, its speaker vector is used
+        const UtteranceResult *queued_result_ = nullptr;
+
+        // Asynchronous mode, tasks run on the model executor in order
+        Strand *strand_ = nullptr;
+        bool async_failed_ = false;
+        std::mutex callback_mutex_;
+        RecognizerCallback callback_ = nullptr;
+        void *callback_user_data_ = nullptr;
+        string last_partial_;
+
+        Vector<BaseFloat> wave_buffer_;
+
         float sample_frequency_;
         int32 frame_offset_;
 
@@ -114,6 +240,41 @@ class Recognizer {
 
         RecognizerState state_;
         string last_result_;
+
+        // Last result in the structured form, words of all alternatives
+        // are stored together
+        struct ResultWord {
+            int32 id;
+            double start;
+            double end;
+            float conf;
+        };
+        struct ResultAlternative {
+            float confidence;
+            size_t word_begin;
+            size_t word_end;
+        };
+        const string &ResultText(const ResultAlternative &alternative);
+
+        vector<ResultWord> result_words_;
+        vector<ResultAlternative> result_alternatives_;
+        // Start of the utterance in seconds, word times are relative to it
+        double result_start_time_ = 0;
+        Vector<BaseFloat> result_spk_;
+        int result_spk_frames_ = 0;
+        bool result_has_spk_ = false;
+        bool result_nbest_ = false;
+        bool struct_result_ = false;
+
+        // Result serialization, buffers are reused between results
+        JsonWriter json_;
+        string text_;
+
+        // C structures returned by the struct result methods
+        VoskResult c_result_;
+        vector<VoskAlternative> c_alternatives_;
+        vector<VoskWord> c_words_;
+        string struct_strings_;
 };
 
 #endif /* VOSK_KALDI_RECOGNIZER_H */
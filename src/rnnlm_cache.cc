@@ -0,0 +1,121 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rnnlm_cache.h"
+#include "base/timer.h"
+
+RnnlmStateCache::RnnlmStateCache(const rnnlm::RnnlmComputeStateInfo &info, size_t max_states)
+    : info_(info), max_states_(max_states),
+      start_state_(new rnnlm::RnnlmComputeState(info, info.opts.bos_index))
+{
+}
+
+RnnlmStateCache::StatePtr RnnlmStateCache::Successor(const vector<int32> &history,
+                                                     const rnnlm::RnnlmComputeState &prev,
+                                                     int32 word)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(history);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            stats_.hits++;
+            return it->second->second;
+        }
+        stats_.misses++;
+    }
+
+    // Computed without the lock, states are not modified once created
+    Timer timer;
+    StatePtr state(prev.GetSuccessorState(word));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.compute_seconds += timer.Elapsed();
+    // Another recognizer could add the same history meanwhile
+    if (max_states_ > 0 && index_.find(history) == index_.end()) {
+        lru_.emplace_front(history, state);
+        index_[history] = lru_.begin();
+        while (index_.size() > max_states_) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+            stats_.evictions++;
+        }
+    }
+    return state;
+}
+
+RnnlmCacheStats RnnlmStateCache::GetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    RnnlmCacheStats stats = stats_;
+    stats.states = index_.size();
+    return stats;
+}
+
+CachedRnnlmFst::CachedRnnlmFst(int32 max_ngram_order, RnnlmStateCache *cache)
+    : cache_(cache), max_ngram_order_(max_ngram_order),
+      eos_index_(cache->Info().opts.eos_index)
+{
+    Clear();
+}
+
+void CachedRnnlmFst::Clear()
+{
+    vector<Label> bos_seq(1, cache_->Info().opts.bos_index);
+    state_to_wseq_.clear();
+    state_to_history_.clear();
+    state_to_rnnlm_state_.clear();
+    wseq_to_state_.clear();
+    state_to_wseq_.push_back(bos_seq);
+    state_to_history_.push_back(bos_seq);
+    state_to_rnnlm_state_.push_back(cache_->StartState());
+    wseq_to_state_[bos_seq] = 0;
+}
+
+CachedRnnlmFst::Weight CachedRnnlmFst::Final(StateId s)
+{
+    KALDI_ASSERT(static_cast<size_t>(s) < state_to_rnnlm_state_.size());
+    return Weight(-state_to_rnnlm_state_[s]->LogProbOfWord(eos_index_));
+}
+
+bool CachedRnnlmFst::GetArc(StateId s, Label ilabel, fst::StdArc *oarc)
+{
+    KALDI_ASSERT(static_cast<size_t>(s) < state_to_wseq_.size());
+
+    const rnnlm::RnnlmComputeState &rnnlm = *state_to_rnnlm_state_[s];
+    BaseFloat logprob = rnnlm.LogProbOfWord(ilabel);
+
+    vector<Label> wseq = state_to_wseq_[s];
+    wseq.push_back(ilabel);
+    if (max_ngram_order_ > 0) {
+        while (wseq.size() >= static_cast<size_t>(max_ngram_order_)) {
+            wseq.erase(wseq.begin());
+        }
+    }
+
+    auto result = wseq_to_state_.insert(make_pair(wseq, static_cast<StateId>(state_to_wseq_.size())));
+    if (result.second) {
+        vector<Label> history = state_to_history_[s];
+        history.push_back(ilabel);
+        state_to_rnnlm_state_.push_back(cache_->Successor(history, rnnlm, ilabel));
+        state_to_wseq_.push_back(wseq);
+        state_to_history_.push_back(history);
+    }
+
+    oarc->ilabel = ilabel;
+    oarc->olabel = ilabel;
+    oarc->nextstate = result.first->second;
+    oarc->weight = Weight(-logprob);
+    return true;
+}
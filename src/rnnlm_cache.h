@@ -0,0 +1,108 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_RNNLM_CACHE_H
+#define VOSK_RNNLM_CACHE_H
+
+#include "base/kaldi-common.h"
+#include "fstext/deterministic-fst.h"
+#include "rnnlm/rnnlm-compute-state.h"
+#include "util/stl-utils.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+using namespace kaldi;
+using namespace std;
+
+// RNNLM states shared by all recognizers of the model and kept between
+// utterances, so common sentence prefixes are computed once. States are
+// keyed by the full word history from the sentence start, so a cached
+// state is exactly the one the recognizer would compute itself and results
+// don't depend on what other streams decoded before. Least recently used
+// states are evicted once the cache is full.
+struct RnnlmCacheStats {
+    int64 hits = 0;
+    int64 misses = 0;
+    int64 evictions = 0;
+    int64 states = 0;
+    // Time spent in the network computing the missing states
+    double compute_seconds = 0;
+};
+
+class RnnlmStateCache {
+
+public:
+    typedef std::shared_ptr<const rnnlm::RnnlmComputeState> StatePtr;
+
+    RnnlmStateCache(const rnnlm::RnnlmComputeStateInfo &info, size_t max_states);
+
+    const rnnlm::RnnlmComputeStateInfo &Info() const { return info_; }
+    StatePtr StartState() const { return start_state_; }
+
+    // Returns the state for the full history which ends with the word,
+    // computes it from the previous state if it is not cached
+    StatePtr Successor(const vector<int32> &history,
+                       const rnnlm::RnnlmComputeState &prev, int32 word);
+
+    RnnlmCacheStats GetStats();
+
+private:
+    typedef list<pair<vector<int32>, StatePtr> > LruList;
+
+    const rnnlm::RnnlmComputeStateInfo &info_;
+    size_t max_states_;
+    StatePtr start_state_;
+
+    std::mutex mutex_;
+    LruList lru_;
+    unordered_map<vector<int32>, LruList::iterator, VectorHasher<int32> > index_;
+    RnnlmCacheStats stats_;
+};
+
+// Same as KaldiRnnlmDeterministicFst but takes the states from the shared
+// cache. Histories are truncated and merged only within the lattice, the
+// state of the first path which reaches a truncated history is used for all
+// of its paths, as in KaldiRnnlmDeterministicFst. Clear() drops only the
+// state numbering of this lattice.
+class CachedRnnlmFst : public fst::DeterministicOnDemandFst<fst::StdArc> {
+
+public:
+    typedef fst::StdArc::Weight Weight;
+    typedef fst::StdArc::StateId StateId;
+    typedef fst::StdArc::Label Label;
+
+    CachedRnnlmFst(int32 max_ngram_order, RnnlmStateCache *cache);
+
+    StateId Start() override { return 0; }
+    Weight Final(StateId s) override;
+    bool GetArc(StateId s, Label ilabel, fst::StdArc *oarc) override;
+
+    void Clear();
+
+private:
+    RnnlmStateCache *cache_;
+    int32 max_ngram_order_;
+    int32 eos_index_;
+
+    vector<vector<Label> > state_to_wseq_;
+    // Full history of the path which created the state, key in the cache
+    vector<vector<Label> > state_to_history_;
+    vector<RnnlmStateCache::StatePtr> state_to_rnnlm_state_;
+    unordered_map<vector<Label>, StateId, VectorHasher<Label> > wseq_to_state_;
+};
+
+#endif /* VOSK_RNNLM_CACHE_H */
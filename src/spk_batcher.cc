@@ -0,0 +1,172 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "spk_batcher.h"
+#include "nnet3/nnet-compute.h"
+#include "executor.h"
+
+#include <algorithm>
+
+NnetBatcher::NnetBatcher(const nnet3::Nnet &nnet, const string &input_name,
+                         int32 left_context, int32 right_context,
+                         int32 max_batch, float max_wait)
+    : nnet_(nnet), input_name_(input_name),
+      left_context_(left_context), right_context_(right_context),
+      max_batch_(max_batch),
+      max_wait_(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<float>(max_wait)))
+{
+    // Computations are cached for each batch size and length
+    nnet3::NnetOptimizeOptions optimize_opts;
+    nnet3::CachingOptimizingCompilerOptions compiler_opts;
+    compiler_opts.cache_capacity = 256;
+    compiler_ = new nnet3::CachingOptimizingCompiler(nnet_, optimize_opts, compiler_opts);
+    HelperThreadStarted();
+}
+
+NnetBatcher::~NnetBatcher()
+{
+    delete compiler_;
+    HelperThreadStopped();
+}
+
+void NnetBatcher::Compute(const MatrixBase<BaseFloat> &input, Matrix<BaseFloat> *output)
+{
+    KALDI_ASSERT(input.NumRows() > left_context_ + right_context_);
+
+    Request request;
+    request.input = &input;
+    request.output = output;
+    request.done = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    request.deadline = std::chrono::steady_clock::now() + max_wait_;
+    queues_[input.NumRows()].push_back(&request);
+    cv_.notify_all();
+
+    while (!request.done) {
+        auto it = queues_.find(input.NumRows());
+        if (it == queues_.end() ||
+            std::find(it->second.begin(), it->second.end(), &request) == it->second.end()) {
+            // Another thread runs the batch with this request
+            cv_.wait(lock);
+            continue;
+        }
+
+        // Requests collect while other batches compute, if nothing is
+        // running there is no reason to wait for more
+        deque<Request *> &queue = it->second;
+        if (queue.size() >= static_cast<size_t>(max_batch_) || num_running_ == 0 ||
+            std::chrono::steady_clock::now() >= queue.front()->deadline) {
+            RunBatch(it, &lock);
+        } else {
+            cv_.wait_until(lock, queue.front()->deadline);
+        }
+    }
+
+    if (request.error)
+        std::rethrow_exception(request.error);
+}
+
+void NnetBatcher::GetStats(int64 *batches, int64 *requests)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    *batches = batches_;
+    *requests = requests_;
+}
+
+void NnetBatcher::RunBatch(map<int32, deque<Request *> >::iterator queue,
+                           std::unique_lock<std::mutex> *lock)
+{
+    vector<Request *> batch;
+    while (!queue->second.empty() && batch.size() < static_cast<size_t>(max_batch_)) {
+        batch.push_back(queue->second.front());
+        queue->second.pop_front();
+    }
+    if (queue->second.empty())
+        queues_.erase(queue);
+    num_running_++;
+    batches_++;
+    requests_ += batch.size();
+    lock->unlock();
+
+    std::exception_ptr error;
+    try {
+        ComputeBatch(batch);
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    lock->lock();
+    for (Request *request : batch) {
+        request->error = error;
+        request->done = true;
+    }
+    num_running_--;
+    cv_.notify_all();
+}
+
+// Sequences of the batch differ in "n" index, rows are ordered by time with
+// "n" varying fastest as in merged training examples
+void NnetBatcher::ComputeBatch(const vector<Request *> &batch)
+{
+    int32 batch_size = batch.size(),
+        num_rows = batch[0]->input->NumRows(),
+        num_cols = batch[0]->input->NumCols();
+
+    nnet3::ComputationRequest request;
+    request.need_model_derivative = false;
+    request.store_component_stats = false;
+    request.inputs.resize(1);
+    request.inputs[0].name = input_name_;
+    for (int32 t = 0; t < num_rows; t++) {
+        for (int32 n = 0; n < batch_size; n++)
+            request.inputs[0].indexes.push_back(nnet3::Index(n, t));
+    }
+    request.outputs.resize(1);
+    request.outputs[0].name = "output";
+    for (int32 t = left_context_; t < num_rows - right_context_; t++) {
+        for (int32 n = 0; n < batch_size; n++)
+            request.outputs[0].indexes.push_back(nnet3::Index(n, t));
+    }
+    shared_ptr<const nnet3::NnetComputation> computation;
+    {
+        std::lock_guard<std::mutex> lock(compiler_mutex_);
+        computation = compiler_->Compile(request);
+    }
+
+    Matrix<BaseFloat> input(num_rows * batch_size, num_cols, kUndefined);
+    for (int32 t = 0; t < num_rows; t++) {
+        for (int32 n = 0; n < batch_size; n++)
+            input.Row(t * batch_size + n).CopyFromVec(batch[n]->input->Row(t));
+    }
+
+    nnet3::Nnet *nnet_to_update = nullptr;  // we're not doing any update.
+    nnet3::NnetComputer computer(nnet3::NnetComputeOptions(), *computation,
+                                 nnet_, nnet_to_update);
+    CuMatrix<BaseFloat> input_cu;
+    input_cu.Swap(&input);
+    computer.AcceptInput(input_name_, &input_cu);
+    computer.Run();
+    CuMatrix<BaseFloat> output_cu;
+    computer.GetOutputDestructive("output", &output_cu);
+    Matrix<BaseFloat> output(output_cu);
+
+    int32 num_outputs = num_rows - left_context_ - right_context_;
+    for (int32 n = 0; n < batch_size; n++) {
+        batch[n]->output->Resize(num_outputs, output.NumCols(), kUndefined);
+        for (int32 t = 0; t < num_outputs; t++)
+            batch[n]->output->Row(t).CopyFromVec(output.Row(t * batch_size + n));
+    }
+}
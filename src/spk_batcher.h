@@ -0,0 +1,90 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_SPK_BATCHER_H
+#define VOSK_SPK_BATCHER_H
+
+#include "base/kaldi-common.h"
+#include "matrix/kaldi-matrix.h"
+#include "nnet3/nnet-optimize.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+
+using namespace kaldi;
+using namespace std;
+
+// Runs requests of one network from many threads together. Requests with
+// the same number of input frames are computed as separate sequences of
+// one computation. There is no batching thread, the caller whose request
+// fills a batch or reaches the deadline of the oldest request in its batch
+// runs the batch on its own thread, so several batches run in parallel.
+// Requests collect while other batches are computing and wait for their
+// batch to fill at most max_wait seconds. When no batch is running the
+// pending requests run immediately, so a request which has nothing to
+// batch with, like the last short chunk of an utterance, doesn't wait.
+class NnetBatcher {
+
+public:
+    NnetBatcher(const nnet3::Nnet &nnet, const string &input_name,
+                int32 left_context, int32 right_context,
+                int32 max_batch, float max_wait);
+    ~NnetBatcher();
+
+    // Computes "output" for the input frames from left_context till
+    // the last right_context frames, blocks until the batch is done
+    void Compute(const MatrixBase<BaseFloat> &input, Matrix<BaseFloat> *output);
+
+    void GetStats(int64 *batches, int64 *requests);
+
+private:
+    struct Request {
+        const MatrixBase<BaseFloat> *input;
+        Matrix<BaseFloat> *output;
+        std::chrono::steady_clock::time_point deadline;
+        bool done;
+        std::exception_ptr error;
+    };
+
+    // Takes up to max_batch requests of the queue and runs them,
+    // called with the lock held
+    void RunBatch(map<int32, deque<Request *> >::iterator queue,
+                  std::unique_lock<std::mutex> *lock);
+    void ComputeBatch(const vector<Request *> &batch);
+
+    const nnet3::Nnet &nnet_;
+    string input_name_;
+    int32 left_context_;
+    int32 right_context_;
+    int32 max_batch_;
+    std::chrono::steady_clock::duration max_wait_;
+
+    nnet3::CachingOptimizingCompiler *compiler_;
+    std::mutex compiler_mutex_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // Pending requests by the number of input frames
+    map<int32, deque<Request *> > queues_;
+    int32 num_running_ = 0;
+
+    int64 batches_ = 0;
+    int64 requests_ = 0;
+};
+
+#endif /* VOSK_SPK_BATCHER_H */
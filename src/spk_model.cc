@@ -13,9 +13,21 @@
 // limitations under the License.
 
 #include "spk_model.h"
+#include "base/timer.h"
+#include "nnet3/nnet-compute.h"
+#include "nnet3/nnet-general-component.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+
+// Frames in a chunk of incremental frame-level computation
+static const int32 kSpkChunkFrames = 100;
+// Frames in the mean normalization window, same as in full computation
+static const int32 kSpkCmnWindow = 300;
 
 SpkModel::SpkModel(const char *speaker_path) {
     std::string speaker_path_str(speaker_path);
+    Timer timer, nnet_timer;
 
     ReadConfigFromFile(speaker_path_str + "/mfcc.conf", &spkvector_mfcc_opts);
     spkvector_mfcc_opts.frame_opts.allow_downsample = true; // It is safe to downsample
@@ -24,18 +36,344 @@ SpkModel::SpkModel(const char *speaker_path) {
     SetBatchnormTestMode(true, &speaker_nnet);
     SetDropoutTestMode(true, &speaker_nnet);
     CollapseModel(nnet3::CollapseModelConfig(), &speaker_nnet);
+    stats_["nnet"].bytes = static_cast<int64>(NumParameters(speaker_nnet)) * sizeof(BaseFloat);
+    stats_["nnet"].load_ms = nnet_timer.Elapsed() * 1000;
+
+    nnet3::NnetOptimizeOptions optimize_opts;
+    nnet3::CachingOptimizingCompilerOptions compiler_opts;
+    compiler_ = new nnet3::CachingOptimizingCompiler(speaker_nnet, optimize_opts, compiler_opts);
 
+    try {
+        SplitNnet();
+    } catch (const std::exception &e) {
+        KALDI_WARN << "Incremental speaker vectors are not supported by this model: " << e.what();
+    }
+    if (split_nnet_) {
+        frame_compiler_ = new nnet3::CachingOptimizingCompiler(frame_nnet_, optimize_opts, compiler_opts);
+        segment_compiler_ = new nnet3::CachingOptimizingCompiler(segment_nnet_, optimize_opts, compiler_opts);
+    }
+
+    Timer transform_timer;
     ReadKaldiObject(speaker_path_str + "/mean.vec", &mean);
     ReadKaldiObject(speaker_path_str + "/transform.mat", &transform);
+    stats_["transform"].bytes = (mean.Dim() + static_cast<int64>(transform.NumRows()) * transform.NumCols()) * sizeof(BaseFloat);
+    stats_["transform"].load_ms = transform_timer.Elapsed() * 1000;
 
+    load_ms_ = timer.Elapsed() * 1000;
     ref_cnt_ = 1;
 }
 
+SpkModel::~SpkModel() {
+    if (cache_dirty_)
+        WriteCache();
+    delete frame_batcher_;
+    delete segment_batcher_;
+    delete compiler_;
+    delete frame_compiler_;
+    delete segment_compiler_;
+}
+
+// Replaces references to node "from" in descriptor with "to"
+static string ReplaceNodeName(const string &descriptor, const string &from, const string &to)
+{
+    auto is_name_char = [](char c) {
+        return isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.';
+    };
+    string result;
+    size_t pos = 0;
+    while (pos < descriptor.size()) {
+        size_t found = descriptor.find(from, pos);
+        if (found == string::npos) {
+            break;
+        }
+        size_t end = found + from.size();
+        result.append(descriptor, pos, found - pos);
+        if ((found > 0 && is_name_char(descriptor[found - 1])) ||
+            (end < descriptor.size() && is_name_char(descriptor[end]))) {
+            result.append(from);
+        } else {
+            result.append(to);
+        }
+        pos = end;
+    }
+    result.append(descriptor, pos, string::npos);
+    return result;
+}
+
+// Splits the x-vector network at statistics pooling. Incremental pooling
+// keeps means and standard deviations of all frames, so only pooling with
+// stddevs and without log-count features is supported.
+void SpkModel::SplitNnet()
+{
+    int32 pooling_node = -1;
+    nnet3::StatisticsPoolingComponent *pooling = nullptr;
+    for (int32 n = 0; n < speaker_nnet.NumNodes(); n++) {
+        if (!speaker_nnet.IsComponentNode(n))
+            continue;
+        nnet3::Component *component = speaker_nnet.GetComponent(speaker_nnet.GetNode(n).u.component_index);
+        pooling = dynamic_cast<nnet3::StatisticsPoolingComponent *>(component);
+        if (pooling) {
+            pooling_node = n;
+            break;
+        }
+    }
+    if (!pooling)
+        return;
+
+    // Component options are only available from its info
+    string info = pooling->Info();
+    for (size_t pos = info.find(", "); pos != string::npos; pos = info.find(", ", pos))
+        info.replace(pos, 2, " ");
+    ConfigLine pooling_config;
+    bool output_stddevs = false;
+    int32 num_log_count_features = -1;
+    if (!pooling_config.ParseLine(info) ||
+        !pooling_config.GetValue("output-stddevs", &output_stddevs) || !output_stddevs ||
+        !pooling_config.GetValue("num-log-count-features", &num_log_count_features) ||
+        num_log_count_features != 0) {
+        KALDI_WARN << "Incremental speaker vectors are not supported for pooling " << pooling->Info();
+        return;
+    }
+    pooling_config.GetValue("variance-floor", &variance_floor_);
+
+    // Pooling input is the statistics extraction, the input of extraction
+    // is the output of frame-level layers
+    string pooling_name = speaker_nnet.GetNodeName(pooling_node);
+    string extraction_name;
+    string frames_descriptor;
+    vector<string> config_lines;
+    speaker_nnet.GetConfigLines(false, &config_lines);
+    vector<ConfigLine> configs(config_lines.size());
+    for (size_t i = 0; i < config_lines.size(); i++) {
+        configs[i].ParseLine(config_lines[i]);
+        string name;
+        configs[i].GetValue("name", &name);
+        if (name == pooling_name) {
+            configs[i].GetValue("input", &extraction_name);
+        }
+    }
+    std::ostringstream segment_config;
+    segment_config << "input-node name=stats dim=" << pooling->OutputDim() << "\n";
+    for (size_t i = 0; i < configs.size(); i++) {
+        string name, input;
+        configs[i].GetValue("name", &name);
+        configs[i].GetValue("input", &input);
+        if (name == extraction_name) {
+            frames_descriptor = input;
+        } else if (name != pooling_name && ReplaceNodeName(input, pooling_name, "stats") != input) {
+            segment_config << ReplaceNodeName(config_lines[i], pooling_name, "stats") << "\n";
+        }
+    }
+    if (frames_descriptor.empty()) {
+        KALDI_WARN << "Incremental speaker vectors are not supported, no statistics extraction before " << pooling_name;
+        return;
+    }
+
+    std::istringstream frame_is("output-node name=output input=" + frames_descriptor + "\n");
+    std::istringstream segment_is(segment_config.str());
+    std::istringstream frame_edit_is("remove-orphans\n");
+    std::istringstream segment_edit_is("remove-orphans remove-orphan-inputs=true\n");
+
+    frame_nnet_ = speaker_nnet;
+    frame_nnet_.ReadConfig(frame_is);
+    nnet3::ReadEditConfig(frame_edit_is, &frame_nnet_);
+    nnet3::ComputeSimpleNnetContext(frame_nnet_, &frame_left_context_, &frame_right_context_);
+
+    segment_nnet_ = speaker_nnet;
+    segment_nnet_.ReadConfig(segment_is);
+    nnet3::ReadEditConfig(segment_edit_is, &segment_nnet_);
+
+    split_nnet_ = true;
+}
+
+static void SetRequest(const string &input, int32 input_frames,
+                       int32 output_begin, int32 output_end,
+                       nnet3::ComputationRequest *request)
+{
+    request->need_model_derivative = false;
+    request->store_component_stats = false;
+    request->inputs.push_back(
+    nnet3::IoSpecification(input, 0, input_frames));
+    nnet3::IoSpecification output_spec("output", output_begin, output_end);
+    request->outputs.resize(1);
+    request->outputs[0].Swap(&output_spec);
+}
+
+shared_ptr<const nnet3::NnetComputation> SpkModel::Compile(nnet3::CachingOptimizingCompiler *compiler,
+                                                           const nnet3::ComputationRequest &request)
+{
+    std::lock_guard<std::mutex> lock(compiler_mutex_);
+    // Requests differ only in the compiler and the number of input frames
+    int32 compiler_index = (compiler == compiler_) ? 0 : (compiler == frame_compiler_) ? 1 : 2;
+    pair<int32, int32> key(compiler_index, request.inputs[0].indexes.size());
+    if (requests_.insert(key).second && !cache_filename_.empty())
+        cache_dirty_ = true;
+    return compiler->Compile(request);
+}
+
+// The cache is valid for the network structure it was compiled for,
+// parameters don't matter. FNV-1a of the network info, std::hash differs
+// between builds.
+string SpkModel::CacheKey()
+{
+    uint64 hash = 14695981039346656037ULL;
+    string info = speaker_nnet.Info();
+    for (char c : info) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream key;
+    key << std::hex << hash << "-" << split_nnet_;
+    return key.str();
+}
+
+bool SpkModel::SetCache(const char *cache_filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(compiler_mutex_);
+        if (!requests_.empty()) {
+            KALDI_WARN << "Computation cache must be set before the speaker model is used";
+            return false;
+        }
+    }
+
+    Timer timer;
+    cache_filename_ = cache_filename;
+    struct stat buffer;
+    if (stat(cache_filename_.c_str(), &buffer) == 0) {
+        try {
+            bool binary;
+            Input ki(cache_filename_, &binary);
+            std::istream &is = ki.Stream();
+            string key;
+            ExpectToken(is, binary, "<SpkComputationCache>");
+            ReadToken(is, binary, &key);
+            if (key != CacheKey()) {
+                KALDI_WARN << "Computation cache " << cache_filename_ << " is for a different model, ignoring it";
+            } else {
+                // Only the list of requests is read if the compiler
+                // cache can't be used, they are compiled below
+                vector<int32> requests;
+                ReadIntegerVector(is, binary, &requests);
+                compiler_->ReadCache(is, binary);
+                if (split_nnet_) {
+                    frame_compiler_->ReadCache(is, binary);
+                    segment_compiler_->ReadCache(is, binary);
+                }
+                for (size_t i = 0; i + 1 < requests.size(); i += 2)
+                    requests_.insert(make_pair(requests[i], requests[i + 1]));
+            }
+        } catch (...) {
+            KALDI_WARN << "Failed to read computation cache " << cache_filename_;
+            requests_.clear();
+        }
+    }
+
+    // The steady state computations, so the first utterance doesn't
+    // wait for them
+    if (split_nnet_) {
+        GetFrameComputation(kSpkChunkFrames);
+        GetSegmentComputation();
+    }
+    stats_["cache"].load_ms = timer.Elapsed() * 1000;
+    return true;
+}
+
+// Written to a temporary file first, other processes may be reading the cache
+void SpkModel::WriteCache()
+{
+    string tmp_filename = cache_filename_ + ".tmp" + std::to_string(getpid());
+    try {
+        {
+            Output ko(tmp_filename, true);
+            std::ostream &os = ko.Stream();
+            WriteToken(os, true, "<SpkComputationCache>");
+            WriteToken(os, true, CacheKey());
+            vector<int32> requests;
+            for (const pair<int32, int32> &request : requests_) {
+                requests.push_back(request.first);
+                requests.push_back(request.second);
+            }
+            WriteIntegerVector(os, true, requests);
+            compiler_->WriteCache(os, true);
+            if (split_nnet_) {
+                frame_compiler_->WriteCache(os, true);
+                segment_compiler_->WriteCache(os, true);
+            }
+        }
+        if (rename(tmp_filename.c_str(), cache_filename_.c_str()) != 0) {
+            KALDI_WARN << "Failed to write computation cache " << cache_filename_;
+            unlink(tmp_filename.c_str());
+        }
+    } catch (...) {
+        KALDI_WARN << "Failed to write computation cache " << cache_filename_;
+        unlink(tmp_filename.c_str());
+    }
+}
+
+shared_ptr<const nnet3::NnetComputation> SpkModel::GetComputation(int32 num_frames)
+{
+    nnet3::ComputationRequest request;
+    SetRequest("input", num_frames, 0, 1, &request);
+    return Compile(compiler_, request);
+}
+
+shared_ptr<const nnet3::NnetComputation> SpkModel::GetFrameComputation(int32 num_frames)
+{
+    nnet3::ComputationRequest request;
+    SetRequest("input", frame_left_context_ + num_frames + frame_right_context_,
+               frame_left_context_, frame_left_context_ + num_frames, &request);
+    return Compile(frame_compiler_, request);
+}
+
+shared_ptr<const nnet3::NnetComputation> SpkModel::GetSegmentComputation()
+{
+    nnet3::ComputationRequest request;
+    SetRequest("stats", 1, 0, 1, &request);
+    return Compile(segment_compiler_, request);
+}
+
 void SpkModel::Ref()
 {
     std::atomic_fetch_add_explicit(&ref_cnt_, 1, std::memory_order_relaxed);
 }
 
+string SpkModel::GetStats()
+{
+    json::JSON obj = ComponentStatsJson(stats_, load_ms_);
+    if (frame_batcher_) {
+        int64 batches, requests;
+        frame_batcher_->GetStats(&batches, &requests);
+        obj["batching"]["frame_batches"] = batches;
+        obj["batching"]["frame_requests"] = requests;
+        segment_batcher_->GetStats(&batches, &requests);
+        obj["batching"]["segment_batches"] = batches;
+        obj["batching"]["segment_requests"] = requests;
+    }
+    return obj.dump();
+}
+
+// Batching works on the split network, the frame-level part runs on chunks
+// of the same length which batch well
+void SpkModel::SetBatching(int32 max_batch, float max_wait)
+{
+    delete frame_batcher_;
+    delete segment_batcher_;
+    frame_batcher_ = nullptr;
+    segment_batcher_ = nullptr;
+
+    if (max_batch <= 1)
+        return;
+
+    if (!split_nnet_) {
+        KALDI_WARN << "Batching is not supported by this speaker model";
+        return;
+    }
+    frame_batcher_ = new NnetBatcher(frame_nnet_, "input", frame_left_context_, frame_right_context_,
+                                     max_batch, max_wait);
+    segment_batcher_ = new NnetBatcher(segment_nnet_, "stats", 0, 0, max_batch, max_wait);
+}
+
 void SpkModel::Unref()
 {
     if (std::atomic_fetch_sub_explicit(&ref_cnt_, 1, std::memory_order_release) == 1) {
@@ -43,3 +381,164 @@ void SpkModel::Unref()
          delete this;
     }
 }
+
+OnlineXvectorStats::OnlineXvectorStats(SpkModel *spk_model) : spk_model_(spk_model)
+{
+    KALDI_ASSERT(spk_model_->split_nnet_);
+    Reset();
+}
+
+void OnlineXvectorStats::Reset()
+{
+    cmn_count_ = 0;
+    cmn_next_ = 0;
+    cmn_sum_.Resize(0);
+    buffer_rows_ = 0;
+    out_begin_ = spk_model_->frame_left_context_;
+    sum_.Resize(spk_model_->frame_nnet_.OutputDim("output"));
+    sum_sq_.Resize(spk_model_->frame_nnet_.OutputDim("output"));
+    num_outputs_ = 0;
+    num_frames_ = 0;
+}
+
+void OnlineXvectorStats::AcceptFrame(const VectorBase<BaseFloat> &feat)
+{
+    if (cmn_sum_.Dim() != feat.Dim()) {
+        cmn_frames_.Resize(kSpkCmnWindow, feat.Dim());
+        cmn_sum_.Resize(feat.Dim());
+    }
+
+    if (cmn_count_ == kSpkCmnWindow) {
+        cmn_sum_.AddVec(-1.0, cmn_frames_.Row(cmn_next_));
+    } else {
+        cmn_count_++;
+    }
+    cmn_frames_.CopyRowFromVec(feat, cmn_next_);
+    cmn_sum_.AddVec(1.0, feat);
+    cmn_next_ = (cmn_next_ + 1) % kSpkCmnWindow;
+
+    SubVector<BaseFloat> row = NextRow(feat.Dim());
+    row.CopyFromVec(feat);
+    row.AddVec(-1.0 / cmn_count_, cmn_sum_);
+    AddRow();
+}
+
+void OnlineXvectorStats::AcceptFeatures(const MatrixBase<BaseFloat> &features)
+{
+    for (int32 i = 0; i < features.NumRows(); i++) {
+        NextRow(features.NumCols()).CopyFromVec(features.Row(i));
+        AddRow();
+    }
+}
+
+SubVector<BaseFloat> OnlineXvectorStats::NextRow(int32 dim)
+{
+    if (buffer_.NumCols() != dim) {
+        buffer_.Resize(spk_model_->frame_left_context_ + kSpkChunkFrames + spk_model_->frame_right_context_,
+                       dim);
+    }
+    return buffer_.Row(buffer_rows_);
+}
+
+// Adds the row filled after NextRow and runs the chunk once it is full
+void OnlineXvectorStats::AddRow()
+{
+    buffer_rows_++;
+    num_frames_++;
+
+    if (buffer_rows_ == buffer_.NumRows()) {
+        ComputeFrames(buffer_rows_ - spk_model_->frame_right_context_);
+
+        // Keep the context of the next chunk
+        int32 keep = spk_model_->frame_left_context_ + spk_model_->frame_right_context_;
+        int32 first = buffer_rows_ - keep;
+        for (int32 i = 0; i < keep; i++) {
+            buffer_.Row(i).CopyFromVec(buffer_.Row(first + i));
+        }
+        buffer_rows_ = keep;
+        out_begin_ = spk_model_->frame_left_context_;
+    }
+}
+
+void OnlineXvectorStats::Flush()
+{
+    ComputeFrames(buffer_rows_ - spk_model_->frame_right_context_);
+}
+
+// Runs frame-level layers on buffer rows from out_begin_ till end and adds
+// their outputs to the statistics
+void OnlineXvectorStats::ComputeFrames(int32 end)
+{
+    int32 num_outputs = end - out_begin_;
+    if (num_outputs <= 0)
+        return;
+
+    int32 left_context = spk_model_->frame_left_context_;
+    SubMatrix<BaseFloat> input(buffer_, out_begin_ - left_context,
+                               left_context + num_outputs + spk_model_->frame_right_context_,
+                               0, buffer_.NumCols());
+
+    Matrix<BaseFloat> output;
+    if (spk_model_->frame_batcher_) {
+        spk_model_->frame_batcher_->Compute(input, &output);
+    } else {
+        shared_ptr<const nnet3::NnetComputation> computation = spk_model_->GetFrameComputation(num_outputs);
+        nnet3::NnetComputer computer(nnet3::NnetComputeOptions(), *computation,
+                                     spk_model_->frame_nnet_, nullptr);
+        CuMatrix<BaseFloat> input_cu(input);
+        computer.AcceptInput("input", &input_cu);
+        computer.Run();
+        CuMatrix<BaseFloat> output_cu;
+        computer.GetOutputDestructive("output", &output_cu);
+        output.Resize(output_cu.NumRows(), output_cu.NumCols(), kUndefined);
+        output_cu.CopyToMat(&output);
+    }
+    Vector<BaseFloat> stats(output.NumCols());
+    stats.AddRowSumMat(1.0, output, 0.0);
+    sum_.AddVec(1.0, stats);
+    stats.AddDiagMat2(1.0, output, kTrans, 0.0);
+    sum_sq_.AddVec(1.0, stats);
+    num_outputs_ += num_outputs;
+
+    out_begin_ = end;
+}
+
+bool OnlineXvectorStats::GetXvector(Vector<BaseFloat> *xvector)
+{
+    if (num_outputs_ == 0)
+        return false;
+
+    // Same statistics as stats pooling computes, means and then
+    // standard deviations
+    int32 dim = sum_.Dim();
+    Vector<double> mean(sum_);
+    mean.Scale(1.0 / num_outputs_);
+    Vector<double> variance(sum_sq_);
+    variance.Scale(1.0 / num_outputs_);
+    variance.AddVec2(-1.0, mean);
+    variance.ApplyFloor(spk_model_->variance_floor_);
+    variance.ApplyPow(0.5);
+
+    Matrix<BaseFloat> stats(1, 2 * dim);
+    stats.Row(0).Range(0, dim).CopyFromVec(mean);
+    stats.Row(0).Range(dim, dim).CopyFromVec(variance);
+
+    Matrix<BaseFloat> output;
+    if (spk_model_->segment_batcher_) {
+        spk_model_->segment_batcher_->Compute(stats, &output);
+    } else {
+        shared_ptr<const nnet3::NnetComputation> computation = spk_model_->GetSegmentComputation();
+        nnet3::NnetComputer computer(nnet3::NnetComputeOptions(), *computation,
+                                     spk_model_->segment_nnet_, nullptr);
+        CuMatrix<BaseFloat> stats_cu(stats);
+        computer.AcceptInput("stats", &stats_cu);
+        computer.Run();
+        CuMatrix<BaseFloat> output_cu;
+        computer.GetOutputDestructive("output", &output_cu);
+        output.Resize(output_cu.NumRows(), output_cu.NumCols(), kUndefined);
+        output_cu.CopyToMat(&output);
+    }
+    xvector->Resize(output.NumCols());
+    xvector->CopyFromVec(output.Row(0));
+    return true;
+}
@@ -18,11 +18,17 @@
 #include "base/kaldi-common.h"
 #include "online2/online-feature-pipeline.h"
 #include "nnet3/nnet-utils.h"
+#include "nnet3/nnet-optimize.h"
+#include "model.h"
+#include "spk_batcher.h"
 #include <atomic>
+#include <mutex>
+#include <set>
 
 using namespace kaldi;
 
 class Recognizer;
+class OnlineXvectorStats;
 
 class SpkModel {
 
@@ -30,10 +36,32 @@ public:
     SpkModel(const char *spk_path);
     void Ref();
     void Unref();
+    string GetStats();
+    void SetBatching(int32 max_batch, float max_wait);
+    // Reuses compiled computations from the file and writes new ones back
+    // when the model is released, must be set before the model is used
+    bool SetCache(const char *cache_filename);
 
 protected:
     friend class Recognizer;
-    ~SpkModel() {};
+    friend class OnlineXvectorStats;
+    ~SpkModel();
+
+    // Returns x-vector computation for the given number of frames. Compiled
+    // computations are cached by length and shared between recognizers.
+    shared_ptr<const nnet3::NnetComputation> GetComputation(int32 num_frames);
+
+    // Computations of the split network for incremental mode, frame-level
+    // outputs for num_frames frames and x-vector from pooled statistics
+    shared_ptr<const nnet3::NnetComputation> GetFrameComputation(int32 num_frames);
+    shared_ptr<const nnet3::NnetComputation> GetSegmentComputation();
+
+    void SplitNnet();
+    shared_ptr<const nnet3::NnetComputation> Compile(nnet3::CachingOptimizingCompiler *compiler,
+                                                     const nnet3::ComputationRequest &request);
+
+    string CacheKey();
+    void WriteCache();
 
     kaldi::nnet3::Nnet speaker_nnet;
     kaldi::Vector<BaseFloat> mean;
@@ -41,7 +69,83 @@ protected:
 
     MfccOptions spkvector_mfcc_opts;
 
+    nnet3::CachingOptimizingCompiler *compiler_ = nullptr;
+    std::mutex compiler_mutex_;
+    // Persisted computation cache, disabled if the file name is empty.
+    // Requests by compiler index and number of input frames.
+    string cache_filename_;
+    std::set<pair<int32, int32> > requests_;
+    bool cache_dirty_ = false;
+
+    // Network split at statistics pooling, frame_nnet_ runs frame-level
+    // layers and segment_nnet_ takes means and standard deviations of
+    // their outputs. Empty if the network can't be split.
+    bool split_nnet_ = false;
+    nnet3::Nnet frame_nnet_;
+    nnet3::Nnet segment_nnet_;
+    int32 frame_left_context_ = 0;
+    int32 frame_right_context_ = 0;
+    BaseFloat variance_floor_ = 1.0e-10;
+    nnet3::CachingOptimizingCompiler *frame_compiler_ = nullptr;
+    nnet3::CachingOptimizingCompiler *segment_compiler_ = nullptr;
+
+    // Batched computation of the split network for all recognizers,
+    // null if batching is disabled
+    NnetBatcher *frame_batcher_ = nullptr;
+    NnetBatcher *segment_batcher_ = nullptr;
+
+    map<string, ComponentStats> stats_;
+    float load_ms_ = 0;
+
     std::atomic<int> ref_cnt_;
 };
 
+// Speaker statistics collected while audio arrives. Features are normalized
+// with a sliding window which looks only back, the frame-level layers run
+// on chunks and their outputs are pooled with running sums, so the x-vector
+// at the end of utterance needs only the last chunk and the segment layers.
+class OnlineXvectorStats {
+
+public:
+    OnlineXvectorStats(SpkModel *spk_model);
+
+    void Reset();
+    void AcceptFrame(const VectorBase<BaseFloat> &feat);
+    // Adds frames which are already normalized
+    void AcceptFeatures(const MatrixBase<BaseFloat> &features);
+
+    // Computes frame-level outputs for the frames accepted so far
+    void Flush();
+
+    // Number of accepted frames
+    int32 NumFrames() const { return num_frames_; }
+
+    // X-vector from the frames processed so far, before whitening
+    bool GetXvector(Vector<BaseFloat> *xvector);
+
+private:
+    SubVector<BaseFloat> NextRow(int32 dim);
+    void AddRow();
+    void ComputeFrames(int32 end);
+
+    SpkModel *spk_model_;
+
+    // Ring buffer of raw features for mean normalization
+    Matrix<BaseFloat> cmn_frames_;
+    Vector<double> cmn_sum_;
+    int32 cmn_count_ = 0;
+    int32 cmn_next_ = 0;
+
+    // Normalized features, rows before out_begin_ are only the left context
+    // for the next chunk
+    Matrix<BaseFloat> buffer_;
+    int32 buffer_rows_ = 0;
+    int32 out_begin_ = 0;
+
+    Vector<double> sum_;
+    Vector<double> sum_sq_;
+    int32 num_outputs_ = 0;
+    int32 num_frames_ = 0;
+};
+
 #endif /* VOSK_SPK_MODEL_H */
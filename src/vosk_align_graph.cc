@@ -0,0 +1,67 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Converts decoding graph into the aligned const FST layout. Model maps such
+// graphs into memory instead of reading them, see ModelOptions::mmap_graph.
+
+#include "base/kaldi-common.h"
+#include "util/parse-options.h"
+#include "fstext/kaldi-fst-io.h"
+
+#include <fstream>
+
+using namespace kaldi;
+
+int main(int argc, char *argv[])
+{
+    try {
+        const char *usage =
+            "Converts decoding graph to aligned const FST which can be mapped into memory\n"
+            "\n"
+            "Usage:  vosk_align_graph [options] <graph-in> <graph-out>\n"
+            " e.g.: vosk_align_graph model/graph/HCLG.fst model/graph/HCLG.aligned.fst\n";
+
+        ParseOptions po(usage);
+        po.Read(argc, argv);
+
+        if (po.NumArgs() != 2) {
+            po.PrintUsage();
+            return 1;
+        }
+
+        std::string graph_rxfilename = po.GetArg(1),
+            graph_wxfilename = po.GetArg(2);
+
+        fst::Fst<fst::StdArc> *graph = fst::ReadFstKaldiGeneric(graph_rxfilename);
+        fst::ConstFst<fst::StdArc> const_graph(*graph);
+        delete graph;
+
+        // Alignment is computed relative to the stream start, so we
+        // write to the file directly instead of kaldi::Output
+        std::ofstream os(graph_wxfilename, std::ios_base::out | std::ios_base::binary);
+        fst::FstWriteOptions wopts(graph_wxfilename);
+        wopts.align = true;
+        if (!os || !const_graph.Write(os, wopts)) {
+            KALDI_ERR << "Could not write graph to " << graph_wxfilename;
+        }
+
+        KALDI_LOG << "Wrote aligned graph with " << const_graph.NumStates()
+                  << " states to " << graph_wxfilename;
+        return 0;
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return -1;
+    }
+}
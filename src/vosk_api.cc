@@ -16,6 +16,7 @@
 
 #include "recognizer.h"
 #include "model.h"
+#include "model_generation.h"
 #include "spk_model.h"
 #include "postprocessor.h"
 
@@ -25,18 +26,72 @@
 #endif
 
 #include <string.h>
+#include <sys/stat.h>
 
 using namespace kaldi;
 
 VoskModel *vosk_model_new(const char *model_path)
 {
     try {
-        return (VoskModel *)new Model(model_path);
+        return (VoskModel *)Model::Acquire(model_path);
     } catch (...) {
         return nullptr;
     }
 }
 
+VoskModel *vosk_model_new_from_bundle(const char *bundle_path)
+{
+    struct stat buffer;
+    if (stat(bundle_path, &buffer) != 0 || !S_ISREG(buffer.st_mode)) {
+        KALDI_WARN << "Model bundle " << bundle_path << " is not a regular file";
+        return nullptr;
+    }
+    return vosk_model_new(bundle_path);
+}
+
+float vosk_model_warmup(VoskModel *model, float seconds, int n_threads)
+{
+    try {
+        return ((Model *)model)->Warmup(seconds, n_threads);
+    } catch (...) {
+        return -1;
+    }
+}
+
+int vosk_model_preload_for_fork(VoskModel *model)
+{
+    try {
+        ((Model *)model)->PreloadForFork();
+        return 1;
+    } catch (...) {
+        return 0;
+    }
+}
+
+char *vosk_model_get_stats(VoskModel *model)
+{
+    return strdup(((Model *)model)->GetStats().c_str());
+}
+
+char *vosk_spk_model_get_stats(VoskSpkModel *model)
+{
+    return strdup(((SpkModel *)model)->GetStats().c_str());
+}
+
+long long vosk_model_registry_hits()
+{
+    int64 hits, misses;
+    Model::GetRegistryStats(&hits, &misses);
+    return hits;
+}
+
+long long vosk_model_registry_misses()
+{
+    int64 hits, misses;
+    Model::GetRegistryStats(&hits, &misses);
+    return misses;
+}
+
 void vosk_model_free(VoskModel *model)
 {
     if (model == nullptr) {
@@ -50,6 +105,41 @@ int vosk_model_find_word(VoskModel *model, const char *word)
     return (int) ((Model *)model)->FindWord(word);
 }
 
+VoskModelGeneration *vosk_model_generation_new(VoskModel *model)
+{
+    return (VoskModelGeneration *)new ModelGeneration((Model *)model);
+}
+
+void vosk_model_generation_free(VoskModelGeneration *generation)
+{
+    delete (ModelGeneration *)generation;
+}
+
+VoskModel *vosk_model_generation_acquire(VoskModelGeneration *generation)
+{
+    return (VoskModel *)((ModelGeneration *)generation)->Acquire();
+}
+
+int vosk_model_generation_number(VoskModelGeneration *generation)
+{
+    return ((ModelGeneration *)generation)->Generation();
+}
+
+void vosk_model_generation_swap(VoskModelGeneration *generation, VoskModel *model)
+{
+    ((ModelGeneration *)generation)->Swap((Model *)model);
+}
+
+int vosk_model_generation_load(VoskModelGeneration *generation, const char *model_path, float warmup_seconds)
+{
+    return ((ModelGeneration *)generation)->Load(model_path, warmup_seconds);
+}
+
+int vosk_model_generation_wait(VoskModelGeneration *generation)
+{
+    return ((ModelGeneration *)generation)->Wait();
+}
+
 VoskSpkModel *vosk_spk_model_new(const char *model_path)
 {
     try {
@@ -67,6 +157,22 @@ void vosk_spk_model_free(VoskSpkModel *model)
     ((SpkModel *)model)->Unref();
 }
 
+void vosk_spk_model_set_batching(VoskSpkModel *model, int max_batch, float max_wait)
+{
+    if (model == nullptr) {
+       return;
+    }
+    ((SpkModel *)model)->SetBatching(max_batch, max_wait);
+}
+
+int vosk_spk_model_set_cache(VoskSpkModel *model, const char *cache_path)
+{
+    if (model == nullptr || cache_path == nullptr) {
+       return 0;
+    }
+    return ((SpkModel *)model)->SetCache(cache_path) ? 1 : 0;
+}
+
 VoskRecognizer *vosk_recognizer_new(VoskModel *model, float sample_rate)
 {
     try {
@@ -122,6 +228,22 @@ void vosk_recognizer_set_spk_model(VoskRecognizer *recognizer, VoskSpkModel *spk
     ((Recognizer *)recognizer)->SetSpkModel((SpkModel *)spk_model);
 }
 
+void vosk_recognizer_set_spk_incremental(VoskRecognizer *recognizer, int incremental)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->SetSpkIncremental((bool)incremental);
+}
+
+void vosk_recognizer_set_partial_spk(VoskRecognizer *recognizer, int partial_spk)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->SetPartialSpk((bool)partial_spk);
+}
+
 void vosk_recognizer_set_grm(VoskRecognizer *recognizer, char const *grammar)
 {
     if (recognizer == nullptr) {
@@ -146,6 +268,75 @@ void vosk_recognizer_set_endpointer_delays(VoskRecognizer *recognizer, float t_s
     ((Recognizer *)recognizer)->SetEndpointerDelays(t_start_max, t_end, t_max);
 }
 
+void vosk_recognizer_set_decode_step(VoskRecognizer *recognizer, float step)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->SetDecodeStep(step);
+}
+
+void vosk_recognizer_set_latency_target(VoskRecognizer *recognizer, float latency)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->SetLatencyTarget(latency);
+}
+
+void vosk_recognizer_set_callback(VoskRecognizer *recognizer, VoskResultCallback callback, void *user_data)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->SetCallback(callback, user_data);
+}
+
+int vosk_recognizer_accept_waveform_async(VoskRecognizer *recognizer, const char *data, int length)
+{
+    if (recognizer == nullptr) {
+       return -1;
+    }
+    try {
+        ((Recognizer *)recognizer)->AcceptWaveformAsync(data, length);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+void vosk_recognizer_finish_async(VoskRecognizer *recognizer)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->FinishAsync();
+}
+
+int vosk_recognizer_wait(VoskRecognizer *recognizer)
+{
+    if (recognizer == nullptr) {
+       return 0;
+    }
+    return ((Recognizer *)recognizer)->WaitAsync() ? 1 : 0;
+}
+
+void vosk_recognizer_set_pipelined(VoskRecognizer *recognizer, int pipelined)
+{
+    if (recognizer == nullptr) {
+       return;
+    }
+    ((Recognizer *)recognizer)->SetPipelined(pipelined);
+}
+
+float vosk_recognizer_get_rtf(VoskRecognizer *recognizer)
+{
+    if (recognizer == nullptr) {
+       return 0;
+    }
+    return ((Recognizer *)recognizer)->GetRtf();
+}
+
 int vosk_recognizer_accept_waveform(VoskRecognizer *recognizer, const char *data, int length)
 {
     try {
@@ -188,6 +379,33 @@ const char *vosk_recognizer_final_result(VoskRecognizer *recognizer)
     return ((Recognizer *)recognizer)->FinalResult();
 }
 
+const VoskResult *vosk_recognizer_result_struct(VoskRecognizer *recognizer)
+{
+    try {
+        return ((Recognizer *)recognizer)->ResultStruct();
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+const VoskResult *vosk_recognizer_partial_result_struct(VoskRecognizer *recognizer)
+{
+    try {
+        return ((Recognizer *)recognizer)->PartialResultStruct();
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+const VoskResult *vosk_recognizer_final_result_struct(VoskRecognizer *recognizer)
+{
+    try {
+        return ((Recognizer *)recognizer)->FinalResultStruct();
+    } catch (...) {
+        return nullptr;
+    }
+}
+
 void vosk_recognizer_reset(VoskRecognizer *recognizer)
 {
     ((Recognizer *)recognizer)->Reset();
@@ -27,6 +27,12 @@ extern "C" {
 typedef struct VoskModel VoskModel;
 
 
+/** Model generation holds the current model for new recognizers and
+ *  allows to replace it with a new model while older recognizers
+ *  finish on the previous one. */
+typedef struct VoskModelGeneration VoskModelGeneration;
+
+
 /** Speaker model is the same as model but contains the data
  *  for speaker identification. */
 typedef struct VoskSpkModel VoskSpkModel;
@@ -54,12 +60,99 @@ typedef struct VoskBatchRecognizer VoskBatchRecognizer;
 
 
 /** Loads model data from the file and returns the model object
+ *
+ *  Models are shared within the process. If the model with the same
+ *  canonical path is already loaded, this returns the same object with
+ *  an extra reference instead of loading another copy. Every call still
+ *  needs a matching vosk_model_free.
  *
  * @param model_path: the path of the model on the filesystem
  * @returns model object or NULL if problem occured */
 VoskModel *vosk_model_new(const char *model_path);
 
 
+/** Loads model data from the single file bundle and returns the model object
+ *
+ *  Bundles are created with vosk_pack_model. The bundle is mapped into
+ *  memory, so loading is a single sequential read and aligned graphs
+ *  are used in place without a copy. vosk_model_new also accepts
+ *  bundle paths, this function is just more explicit.
+ *
+ * @param bundle_path: the path of the bundle file on the filesystem
+ * @returns model object or NULL if problem occured */
+VoskModel *vosk_model_new_from_bundle(const char *bundle_path);
+
+
+/** Runs recognition of synthetic audio to warm up the model
+ *
+ *  The first requests after model load are several times slower since
+ *  decoder, feature extraction and lattice code are cold and rescoring
+ *  language models are loaded on first use. Call this after
+ *  vosk_model_new and before serving requests.
+ *
+ *  @param seconds: length of the synthetic audio decoded by every thread
+ *  @param n_threads: number of recognizers to run in parallel, use the
+ *                    number of serving threads
+ *  @returns time spent on warm-up in seconds or -1 on error */
+float vosk_model_warmup(VoskModel *model, float seconds, int n_threads);
+
+
+/** Loads the parts of the model which are otherwise loaded on first use
+ *
+ *  Prefork servers should load the model in the parent process, call
+ *  this function and then fork the workers. Network weights, language
+ *  models and the word table are never written after load, so their
+ *  copy-on-write pages stay shared between the workers. Without this
+ *  call every worker would load private copies of the rescoring LMs
+ *  on its first result.
+ *
+ *  The model memory is not placed in a region independent processes
+ *  can attach to. Those share only memory mapped data: aligned graphs
+ *  (see vosk_align_graph) and model bundles (see vosk_pack_model).
+ *
+ *  Threads are not copied into forked processes, so nothing which starts
+ *  helper threads may run in the parent at fork time: asynchronous
+ *  recognition (vosk_recognizer_accept_waveform_async), pipelined
+ *  recognizers, speaker model batching (vosk_spk_model_set_batching),
+ *  model generation loading (vosk_model_generation_load) and parallel
+ *  model loading or warm-up. The call fails while any of them runs.
+ *
+ *  @returns 1 on success, 0 on error */
+int vosk_model_preload_for_fork(VoskModel *model);
+
+
+/** Returns memory and load time breakdown of the model as JSON
+ *
+ *  Components are am, graph, words, ivector, winfo and, after the
+ *  first final result, rescore_fst, carpa and rnnlm. Every component
+ *  reports "bytes" and "load_ms", the top level has the total bytes
+ *  and load time of the model. Bytes are parameter sizes or file sizes,
+ *  mapped graphs are shared between processes through the page cache.
+ *  With RNNLM rescoring "rnnlm_cache" reports the shared state cache,
+ *  including the network time spent on misses in "compute_ms".
+ *
+ *  @returns JSON string, the caller releases it with free() */
+char *vosk_model_get_stats(VoskModel *model);
+
+
+/** Returns memory and load time breakdown of the speaker model as JSON
+ *
+ *  Same format as vosk_model_get_stats with nnet and transform components.
+ *
+ *  @returns JSON string, the caller releases it with free() */
+char *vosk_spk_model_get_stats(VoskSpkModel *model);
+
+
+/** Returns the number of vosk_model_new calls which reused
+ *  already loaded model */
+long long vosk_model_registry_hits(void);
+
+
+/** Returns the number of vosk_model_new calls which loaded
+ *  the model from disk */
+long long vosk_model_registry_misses(void);
+
+
 /** Releases the model memory
  *
  *  The model object is reference-counted so if some recognizer
@@ -76,6 +169,54 @@ void vosk_model_free(VoskModel *model);
 int vosk_model_find_word(VoskModel *model, const char *word);
 
 
+/** Creates model generation handle with the initial model
+ *
+ *  The handle takes own reference of the model, the caller can
+ *  release its reference with vosk_model_free. */
+VoskModelGeneration *vosk_model_generation_new(VoskModel *model);
+
+
+/** Releases model generation handle
+ *
+ *  Waits for the running background load. Models stay alive
+ *  while recognizers use them. */
+void vosk_model_generation_free(VoskModelGeneration *generation);
+
+
+/** Returns the current model for a new recognizer
+ *
+ *  The returned model has a new reference, release it with
+ *  vosk_model_free after the recognizer is created. */
+VoskModel *vosk_model_generation_acquire(VoskModelGeneration *generation);
+
+
+/** Returns the number of model swaps done so far */
+int vosk_model_generation_number(VoskModelGeneration *generation);
+
+
+/** Makes already loaded model current for new recognizers */
+void vosk_model_generation_swap(VoskModelGeneration *generation, VoskModel *model);
+
+
+/** Starts loading of the new model in a background thread
+ *
+ *  Once loaded and warmed up (see vosk_model_warmup), the model
+ *  becomes current for new recognizers. Serving threads are not
+ *  blocked while the model is loading. The model is always loaded
+ *  from disk, not taken from the shared models of vosk_model_new.
+ *
+ *  @param model_path: the path of the model on the filesystem
+ *  @param warmup_seconds: seconds of synthetic audio for warm-up, 0 to skip
+ *  @returns 1 if loading started, 0 if another load is still running */
+int vosk_model_generation_load(VoskModelGeneration *generation, const char *model_path, float warmup_seconds);
+
+
+/** Waits for the background load to finish
+ *
+ *  @returns 1 if the new model was swapped in, 0 if loading failed */
+int vosk_model_generation_wait(VoskModelGeneration *generation);
+
+
 /** Loads speaker model data from the file and returns the model object
  *
  * @param model_path: the path of the model on the filesystem
@@ -90,6 +231,32 @@ VoskSpkModel *vosk_spk_model_new(const char *model_path);
  *  last recognizer is released, model will be released too. */
 void vosk_spk_model_free(VoskSpkModel *model);
 
+/** Enables batched speaker vector computation
+ *
+ *  Speaker network computations of all recognizers which use the model
+ *  are collected and run together, which is faster with many concurrent
+ *  streams. Batches run on the threads of the recognizers, several at
+ *  once. While batches compute, new computations wait for others at most
+ *  max_wait seconds, when none is running they start immediately.
+ *  Call before creating recognizers.
+ *
+ *  @param max_batch maximum number of streams in one computation, 1 disables batching
+ *  @param max_wait maximum time in seconds to wait for the batch to fill */
+void vosk_spk_model_set_batching(VoskSpkModel *model, int max_batch, float max_wait);
+
+/** Enables the persisted cache of compiled speaker network computations
+ *
+ *  Computations are read from the file if it exists and the computations
+ *  for incremental speaker vectors are compiled right away, so the first
+ *  utterance doesn't wait for the compilation. When the model is released
+ *  the file is rewritten if new computations were compiled. Call before
+ *  creating recognizers.
+ *
+ *  @param cache_path file for the cache, for example final.ext.cache
+ *                    in a writable folder
+ *  @returns 1 on success, 0 if the model is already in use */
+int vosk_spk_model_set_cache(VoskSpkModel *model, const char *cache_path);
+
 /** Creates the recognizer object
  *
  *  The recognizers process the speech and return text using shared model data
@@ -148,6 +315,26 @@ VoskRecognizer *vosk_recognizer_new_grm(VoskModel *model, float sample_rate, con
 void vosk_recognizer_set_spk_model(VoskRecognizer *recognizer, VoskSpkModel *spk_model);
 
 
+/** Computes speaker vector incrementally
+ *
+ * Runs frame-level layers of the speaker network as audio arrives and keeps
+ * running statistics, so the speaker vector is ready at the end of utterance
+ * without a delay. Mean normalization looks only back in this mode, so the
+ * vectors differ slightly from the default mode. Must be set before the audio
+ * is accepted.
+ *
+ * @param incremental     1 to enable, 0 to disable */
+void vosk_recognizer_set_spk_incremental(VoskRecognizer *recognizer, int incremental);
+
+/** Adds speaker vector to partial results
+ *
+ * Works only in incremental mode, the vector is computed from the speech
+ * processed so far and returned once there is enough of it.
+ *
+ * @param partial_spk     boolean value */
+void vosk_recognizer_set_partial_spk(VoskRecognizer *recognizer, int partial_spk);
+
+
 /** Reconfigures recognizer to use grammar
  *
  * @param recognizer   Already running VoskRecognizer
@@ -242,6 +429,55 @@ void vosk_recognizer_set_endpointer_mode(VoskRecognizer *recognizer,  VoskEndpoi
  **/
 void vosk_recognizer_set_endpointer_delays(VoskRecognizer *recognizer, float t_start_max, float t_end, float t_max);
 
+/**
+ * Set decoding step
+ *
+ * Audio is decoded in steps of this length, 0.2 seconds by default.
+ * Smaller steps update the decoder state more often, bigger steps
+ * reduce per-step overhead for offline processing.
+ *
+ * @param step            step in seconds, must be positive
+ **/
+void vosk_recognizer_set_decode_step(VoskRecognizer *recognizer, float step);
+
+/**
+ * Set latency target for adaptive decoding step
+ *
+ * The step is selected from the target and the measured real-time factor,
+ * audio chunks smaller than the step are collected and decoded together.
+ * Use small targets like 0.1 for interactive streams and big ones like 5.0
+ * for offline processing. Results and partial results always include all
+ * the audio accepted so far.
+ *
+ * @param latency         target latency in seconds, 0 disables adaptive mode
+ **/
+void vosk_recognizer_set_latency_target(VoskRecognizer *recognizer, float latency);
+
+/**
+ * Returns real-time factor of the recognizer
+ *
+ * @returns processing time divided by the duration of the accepted audio
+ **/
+float vosk_recognizer_get_rtf(VoskRecognizer *recognizer);
+
+/**
+ * Enables pipelined decoding
+ *
+ * In pipelined mode vosk_recognizer_accept_waveform queues the audio and
+ * returns while a worker thread of the recognizer runs feature extraction
+ * and decoding. The caller can prepare the next chunk in parallel. The
+ * endpoint flag returned by accept_waveform refers to the audio decoded
+ * so far. At an endpoint the worker ends the utterance and goes on
+ * decoding, its result waits until it is taken with vosk_recognizer_result.
+ * accept_waveform returns 1 while such results wait, result returns them
+ * in order. Results not taken before vosk_recognizer_final_result are
+ * joined with the final one, as an ignored endpoint continues the
+ * utterance without pipelining.
+ *
+ * @param pipelined       1 to enable, 0 to disable
+ **/
+void vosk_recognizer_set_pipelined(VoskRecognizer *recognizer, int pipelined);
+
 /** Accept voice data
  *
  *  accept and process new chunk of voice data
@@ -264,6 +500,57 @@ int vosk_recognizer_accept_waveform_s(VoskRecognizer *recognizer, const short *d
 int vosk_recognizer_accept_waveform_f(VoskRecognizer *recognizer, const float *data, int length);
 
 
+typedef enum VoskEvent {
+    VOSK_EVENT_PARTIAL = 0,
+    VOSK_EVENT_RESULT = 1,
+    VOSK_EVENT_FINAL = 2,
+    VOSK_EVENT_ERROR = 3,
+} VoskEvent;
+
+/** Callback for asynchronous recognition events
+ *
+ *  @param user_data - pointer passed to vosk_recognizer_set_callback
+ *  @param event - VOSK_EVENT_PARTIAL when partial result changed,
+ *                 VOSK_EVENT_RESULT on endpoint,
+ *                 VOSK_EVENT_FINAL after vosk_recognizer_finish_async,
+ *                 VOSK_EVENT_ERROR if decoding failed, the audio of the
+ *                 failed call is lost and no result is reported for it
+ *  @param json - result in the same format as the result functions return,
+ *                or {"error" : "message"} for errors, valid only during the call */
+typedef void (*VoskResultCallback)(void *user_data, int event, const char *json);
+
+
+/** Sets callback for asynchronous recognition events
+ *
+ *  Callbacks are called from the model worker threads, events of one
+ *  recognizer come in order. Don't free the recognizer from the callback. */
+void vosk_recognizer_set_callback(VoskRecognizer *recognizer, VoskResultCallback callback, void *user_data);
+
+
+/** Accepts voice data without blocking
+ *
+ *  The data is copied and decoded by the worker threads shared by all
+ *  recognizers of the model, see async-threads model option. Results
+ *  are reported through the callback. Don't mix asynchronous and
+ *  synchronous calls on the same recognizer without vosk_recognizer_wait.
+ *
+ *  @param data - audio data in PCM 16-bit mono format
+ *  @param length - length of the audio data
+ *  @returns 0 if data was queued or -1 on error */
+int vosk_recognizer_accept_waveform_async(VoskRecognizer *recognizer, const char *data, int length);
+
+
+/** Finishes the stream, final result is reported with VOSK_EVENT_FINAL */
+void vosk_recognizer_finish_async(VoskRecognizer *recognizer);
+
+
+/** Waits until all queued audio is processed and callbacks are called
+ *
+ *  @returns 1 on success, 0 if processing failed since the previous wait,
+ *           errors are reported with VOSK_EVENT_ERROR */
+int vosk_recognizer_wait(VoskRecognizer *recognizer);
+
+
 /** Returns speech recognition result
  *
  * @returns the result in JSON format which contains decoded line, decoded
@@ -306,6 +593,60 @@ const char *vosk_recognizer_partial_result(VoskRecognizer *recognizer);
 const char *vosk_recognizer_final_result(VoskRecognizer *recognizer);
 
 
+/** Word of the structured result */
+typedef struct VoskWord {
+    int id;             /* word id in the model word symbol table */
+    const char *word;   /* word text */
+    double start;       /* start time in seconds */
+    double end;         /* end time in seconds */
+    float conf;         /* word confidence, 0 where it is not computed */
+} VoskWord;
+
+/** Alternative of the structured result */
+typedef struct VoskAlternative {
+    const char *text;        /* decoded line */
+    float confidence;        /* alternative likelihood */
+    int num_words;
+    const VoskWord *words;
+} VoskAlternative;
+
+/** Recognition result in the structured form
+ *
+ *  Contains the same information as the JSON result. Word times are zero in
+ *  the partial result unless partial words are enabled, word confidences
+ *  are zero in the alternatives. */
+typedef struct VoskResult {
+    const char *text;                        /* decoded line, empty if nothing is decoded */
+    int num_words;                           /* words of the best hypothesis */
+    const VoskWord *words;
+    int num_alternatives;                    /* n-best list if vosk_recognizer_set_max_alternatives() is set */
+    const VoskAlternative *alternatives;
+    int spk_dim;                             /* speaker vector if speaker model is set */
+    const float *spk;
+    int spk_frames;
+} VoskResult;
+
+
+/** Returns speech recognition result in the structured form
+ *
+ *  Same as vosk_recognizer_result() but without JSON serialization.
+ *  The result is owned by the recognizer and stays valid until the next
+ *  call on the recognizer.
+ *
+ *  @returns the result or NULL on error */
+const VoskResult *vosk_recognizer_result_struct(VoskRecognizer *recognizer);
+
+
+/** Returns partial speech recognition result in the structured form,
+ *  see vosk_recognizer_result_struct() */
+const VoskResult *vosk_recognizer_partial_result_struct(VoskRecognizer *recognizer);
+
+
+/** Returns final speech recognition result in the structured form,
+ *  see vosk_recognizer_result_struct() */
+const VoskResult *vosk_recognizer_final_result_struct(VoskRecognizer *recognizer);
+
+
 /** Resets the recognizer
  *
  *  Resets current results so the recognition can continue from scratch */
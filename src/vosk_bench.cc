@@ -0,0 +1,391 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Benchmarks of the recognizer hot paths. Each benchmark runs the current
+// implementation and the one it replaced on the same input and prints
+// the time per call of both.
+
+#include "base/kaldi-common.h"
+#include "base/timer.h"
+#include "matrix/kaldi-vector.h"
+#include "util/parse-options.h"
+#include "feat/wave-reader.h"
+#include "nnet3/nnet-utils.h"
+#include "rnnlm/rnnlm-utils.h"
+#include "rnnlm_cache.h"
+#include "json.h"
+#include "json_writer.h"
+#include "vosk_api.h"
+
+#include <sys/stat.h>
+#include <sstream>
+
+using namespace kaldi;
+
+struct BenchOptions {
+    int32 iterations = 100000;
+    int32 chunk_samples = 320;
+    int32 num_words = 20;
+    string model;
+    int32 passes = 3;
+    bool nlsml = false;
+    int32 rnnlm_cache_states = 2000;
+
+    void Register(OptionsItf *opts) {
+        opts->Register("iterations", &iterations, "Number of calls to time");
+        opts->Register("chunk-samples", &chunk_samples, "Samples in one audio chunk, "
+                       "320 is 20 ms at 16 kHz");
+        opts->Register("num-words", &num_words, "Words in one result");
+        opts->Register("model", &model, "Model folder for the benchmarks which decode audio");
+        opts->Register("passes", &passes, "Number of times the audio is decoded");
+        opts->Register("nlsml", &nlsml, "Produce NLSML results in the nbest benchmark");
+        opts->Register("rnnlm-cache-states", &rnnlm_cache_states, "Size of the RNNLM "
+                       "state cache in the rnnlm benchmark");
+    }
+};
+
+static void PrintTime(const char *name, double seconds, int32 iterations)
+{
+    std::cout << name << ": " << seconds * 1e9 / iterations << " ns per call" << std::endl;
+}
+
+// Conversion of int16 audio in AcceptWaveform. The old path allocated a
+// vector for every chunk and converted through the element accessor, the
+// new one converts into a buffer kept by the recognizer.
+static void BenchIngest(const BenchOptions &opts)
+{
+    std::vector<short> samples(opts.chunk_samples);
+    for (size_t i = 0; i < samples.size(); i++)
+        samples[i] = static_cast<short>((i * 7919) % 65536 - 32768);
+    const short *sdata = samples.data();
+    int32 len = samples.size();
+    double checksum = 0;
+
+    Timer timer;
+    for (int32 n = 0; n < opts.iterations; n++) {
+        Vector<BaseFloat> wave;
+        wave.Resize(len, kUndefined);
+        for (int i = 0; i < len; i++)
+            wave(i) = sdata[i];
+        checksum += wave(n % len);
+    }
+    PrintTime("allocating vector per chunk", timer.Elapsed(), opts.iterations);
+
+    Vector<BaseFloat> wave_buffer;
+    timer.Reset();
+    for (int32 n = 0; n < opts.iterations; n++) {
+        if (wave_buffer.Dim() < len)
+            wave_buffer.Resize(len, kUndefined);
+        BaseFloat *wave_data = wave_buffer.Data();
+        for (int i = 0; i < len; i++)
+            wave_data[i] = sdata[i];
+        SubVector<BaseFloat> wave(wave_buffer, 0, len);
+        checksum += wave(n % len);
+    }
+    PrintTime("reused buffer", timer.Elapsed(), opts.iterations);
+
+    KALDI_VLOG(1) << "Checksum " << checksum;
+}
+
+// Serialization of a result with word times. The old path built a json::JSON
+// tree and dumped it, JsonWriter appends to a reused buffer. The outputs
+// must be the same.
+static void BenchJson(const BenchOptions &opts)
+{
+    vector<string> words;
+    vector<double> starts, ends, confs;
+    for (int32 i = 0; i < opts.num_words; i++) {
+        words.push_back("word" + std::to_string(i));
+        starts.push_back(i * 0.51);
+        ends.push_back(i * 0.51 + 0.42);
+        confs.push_back(1.0 - i * 0.01);
+    }
+
+    string tree_result;
+    Timer timer;
+    for (int32 n = 0; n < opts.iterations; n++) {
+        json::JSON obj;
+        std::stringstream text;
+        for (size_t i = 0; i < words.size(); i++) {
+            json::JSON word;
+            word["word"] = words[i];
+            word["start"] = starts[i];
+            word["end"] = ends[i];
+            word["conf"] = confs[i];
+            obj["result"].append(word);
+            if (i) {
+                text << " ";
+            }
+            text << words[i];
+        }
+        obj["text"] = text.str();
+        tree_result = obj.dump();
+    }
+    PrintTime("json::JSON dump", timer.Elapsed(), opts.iterations);
+
+    JsonWriter json;
+    string text;
+    timer.Reset();
+    for (int32 n = 0; n < opts.iterations; n++) {
+        json.Clear();
+        text.clear();
+        json.StartObject();
+        json.Key("result");
+        json.StartArray();
+        for (size_t i = 0; i < words.size(); i++) {
+            json.StartObject();
+            json.Key("conf");
+            json.Float(confs[i]);
+            json.Key("end");
+            json.Float(ends[i]);
+            json.Key("start");
+            json.Float(starts[i]);
+            json.Key("word");
+            json.String(words[i]);
+            json.EndObject();
+            if (i) {
+                text += " ";
+            }
+            text += words[i];
+        }
+        json.EndArray();
+        json.Key("text");
+        json.String(text);
+        json.EndObject();
+    }
+    PrintTime("JsonWriter", timer.Elapsed(), opts.iterations);
+
+    if (json.Buffer() != tree_result) {
+        KALDI_ERR << "Outputs differ:\n" << tree_result << "\n" << json.Buffer();
+    }
+}
+
+// Decodes the audio in chunks and returns the time spent in the result
+// calls. The time of the whole decoding is added to total.
+static double DecodeResults(VoskModel *model, const WaveData &wave, const BenchOptions &opts,
+                            int max_alternatives, double *total)
+{
+    VoskRecognizer *recognizer = vosk_recognizer_new(model, wave.SampFreq());
+    vosk_recognizer_set_max_alternatives(recognizer, max_alternatives);
+    vosk_recognizer_set_words(recognizer, 1);
+    vosk_recognizer_set_nlsml(recognizer, opts.nlsml);
+
+    SubVector<BaseFloat> samples(wave.Data(), 0);
+    double result_seconds = 0;
+    Timer total_timer;
+    for (int32 i = 0; i < samples.Dim(); i += opts.chunk_samples) {
+        int32 len = std::min(opts.chunk_samples, samples.Dim() - i);
+        if (vosk_recognizer_accept_waveform_f(recognizer, samples.Data() + i, len)) {
+            Timer timer;
+            vosk_recognizer_result(recognizer);
+            result_seconds += timer.Elapsed();
+        }
+    }
+    Timer timer;
+    vosk_recognizer_final_result(recognizer);
+    result_seconds += timer.Elapsed();
+    *total += total_timer.Elapsed();
+
+    vosk_recognizer_free(recognizer);
+    return result_seconds;
+}
+
+// N-best results. With a single word-aligned lattice for all the
+// hypotheses, 10 alternatives should cost close to one.
+static void BenchNbest(const BenchOptions &opts, const string &wav_rxfilename)
+{
+    if (opts.model.empty())
+        KALDI_ERR << "The nbest benchmark needs --model";
+
+    WaveData wave;
+    {
+        Input ki(wav_rxfilename);
+        wave.Read(ki.Stream());
+    }
+
+    VoskModel *model = vosk_model_new(opts.model.c_str());
+    if (!model)
+        KALDI_ERR << "Failed to load model " << opts.model;
+
+    // First pass loads the rescoring models and warms up the caches
+    double total = 0;
+    DecodeResults(model, wave, opts, 1, &total);
+
+    for (int max_alternatives : {1, 10}) {
+        double results = 0;
+        total = 0;
+        for (int32 n = 0; n < opts.passes; n++)
+            results += DecodeResults(model, wave, opts, max_alternatives, &total);
+        std::cout << "max_alternatives=" << max_alternatives << ": results "
+                  << results * 1000 / opts.passes << " ms, decoding with results "
+                  << total * 1000 / opts.passes << " ms per pass" << std::endl;
+    }
+
+    vosk_model_free(model);
+}
+
+// Scores every sentence with the RNNLM as the lattice rescoring does, one
+// CachedRnnlmFst cleared per utterance, and returns the total cost
+static double ScoreSentences(const vector<vector<int32> > &sentences, RnnlmStateCache *cache)
+{
+    int lm_order = 4;
+    CachedRnnlmFst fst(lm_order, cache);
+    double cost = 0;
+    for (const vector<int32> &sentence : sentences) {
+        fst.Clear();
+        fst::StdArc::StateId state = fst.Start();
+        for (int32 word : sentence) {
+            fst::StdArc arc;
+            fst.GetArc(state, word, &arc);
+            cost += arc.weight.Value();
+            state = arc.nextstate;
+        }
+        cost += fst.Final(state).Value();
+    }
+    return cost;
+}
+
+// Cross-utterance RNNLM state cache. Scores the sentences of a text file
+// with the model RNNLM, passes times over the set, without the cache and
+// with --rnnlm-cache-states. The costs must be the same.
+static void BenchRnnlm(const BenchOptions &opts, const string &text_rxfilename)
+{
+    if (opts.model.empty())
+        KALDI_ERR << "The rnnlm benchmark needs --model";
+
+    nnet3::Nnet rnnlm;
+    ReadKaldiObject(opts.model + "/rnnlm/final.raw", &rnnlm);
+    Matrix<BaseFloat> feature_embedding_mat;
+    ReadKaldiObject(opts.model + "/rnnlm/feat_embedding.final.mat", &feature_embedding_mat);
+    SparseMatrix<BaseFloat> word_feature_mat;
+    {
+        Input ki(opts.model + "/rnnlm/word_feats.txt");
+        rnnlm::ReadSparseWordFeatures(ki.Stream(), feature_embedding_mat.NumRows(),
+                                      &word_feature_mat);
+    }
+    CuMatrix<BaseFloat> word_embedding_mat(word_feature_mat.NumRows(),
+                                           feature_embedding_mat.NumCols());
+    {
+        Matrix<BaseFloat> wm(word_feature_mat.NumRows(), feature_embedding_mat.NumCols());
+        wm.AddSmatMat(1.0, word_feature_mat, kNoTrans, feature_embedding_mat, 0.0);
+        word_embedding_mat.CopyFromMat(wm);
+    }
+    rnnlm::RnnlmComputeStateComputationOptions compute_opts;
+    {
+        ParseOptions po("");
+        compute_opts.Register(&po);
+        po.ReadConfigFile(opts.model + "/rnnlm/special_symbol_opts.conf");
+    }
+    rnnlm::RnnlmComputeStateInfo info(compute_opts, rnnlm, word_embedding_mat);
+
+    string words_rxfilename = opts.model + "/graph/words.txt";
+    struct stat buffer;
+    if (stat(words_rxfilename.c_str(), &buffer) != 0)
+        words_rxfilename = opts.model + "/words.txt";
+    fst::SymbolTable *word_syms = fst::SymbolTable::ReadText(words_rxfilename);
+    if (!word_syms)
+        KALDI_ERR << "Failed to read word symbols from " << words_rxfilename;
+    int64 unk = word_syms->Find("<unk>");
+
+    vector<vector<int32> > sentences;
+    {
+        Input ki(text_rxfilename);
+        string line;
+        while (std::getline(ki.Stream(), line)) {
+            vector<string> words;
+            SplitStringToVector(line, " \t", true, &words);
+            if (words.empty())
+                continue;
+            vector<int32> sentence;
+            for (const string &word : words) {
+                int64 id = word_syms->Find(word);
+                if (id == fst::kNoSymbol)
+                    id = unk;
+                if (id == fst::kNoSymbol)
+                    KALDI_ERR << "Word " << word << " is not in " << words_rxfilename;
+                sentence.push_back(id);
+            }
+            sentences.push_back(sentence);
+        }
+    }
+    delete word_syms;
+
+    double costs[2];
+    int32 max_states[2] = { 0, opts.rnnlm_cache_states };
+    for (int i = 0; i < 2; i++) {
+        RnnlmStateCache cache(info, max_states[i]);
+        costs[i] = 0;
+        Timer timer;
+        for (int32 n = 0; n < opts.passes; n++)
+            costs[i] += ScoreSentences(sentences, &cache);
+        double seconds = timer.Elapsed();
+        RnnlmCacheStats stats = cache.GetStats();
+        std::cout << "rnnlm-cache-states=" << max_states[i] << ": "
+                  << seconds * 1000 / opts.passes << " ms per pass over "
+                  << sentences.size() << " sentences, compute "
+                  << stats.compute_seconds * 1000 / opts.passes << " ms, hits "
+                  << stats.hits << ", misses " << stats.misses << ", evictions "
+                  << stats.evictions << std::endl;
+    }
+
+    if (!ApproxEqual(costs[0], costs[1]))
+        KALDI_ERR << "Costs differ: " << costs[0] << " " << costs[1];
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        const char *usage =
+            "Benchmarks recognizer hot paths against their previous implementation\n"
+            "\n"
+            "Usage:  vosk_bench [options] <benchmark> [<wav-file>|<text-file>]\n"
+            "Benchmarks:\n"
+            "  ingest    int16 audio conversion in AcceptWaveform\n"
+            "  json      result serialization, json::JSON against JsonWriter\n"
+            "  nbest     result time with max_alternatives 1 and 10, needs --model and wav file\n"
+            "  rnnlm     RNNLM scoring of a text file with and without the state cache, needs --model\n"
+            " e.g.: vosk_bench --chunk-samples=160 ingest\n"
+            "       vosk_bench --model=vosk-model-small-en-us-0.15 nbest test.wav\n"
+            "       vosk_bench --model=vosk-model-en-us-0.22 --passes=2 rnnlm test.txt\n";
+
+        ParseOptions po(usage);
+        BenchOptions opts;
+        opts.Register(&po);
+        po.Read(argc, argv);
+
+        if (po.NumArgs() < 1) {
+            po.PrintUsage();
+            return 1;
+        }
+
+        string benchmark = po.GetArg(1);
+        if (benchmark == "ingest") {
+            BenchIngest(opts);
+        } else if (benchmark == "json") {
+            BenchJson(opts);
+        } else if (benchmark == "nbest" && po.NumArgs() == 2) {
+            BenchNbest(opts, po.GetArg(2));
+        } else if (benchmark == "rnnlm" && po.NumArgs() == 2) {
+            BenchRnnlm(opts, po.GetArg(2));
+        } else {
+            po.PrintUsage();
+            return 1;
+        }
+        return 0;
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return -1;
+    }
+}
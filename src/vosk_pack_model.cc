@@ -0,0 +1,119 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Packs model folder into a single bundle file, see model_bundle.h for the
+// layout. Run vosk_align_graph on the graph first to get it mapped from the
+// bundle without a copy.
+
+#include "model_bundle.h"
+#include "util/parse-options.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+static uint64 AlignOffset(uint64 offset)
+{
+    return (offset + kBundleAlignment - 1) / kBundleAlignment * kBundleAlignment;
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        const char *usage =
+            "Packs model folder into a single file which is mapped into memory on load\n"
+            "\n"
+            "Usage:  vosk_pack_model [options] <model-dir> <bundle-out>\n"
+            " e.g.: vosk_pack_model vosk-model-small-en-us-0.15 vosk-model-small-en-us-0.15.vosk\n";
+
+        ParseOptions po(usage);
+        po.Read(argc, argv);
+
+        if (po.NumArgs() != 2) {
+            po.PrintUsage();
+            return 1;
+        }
+
+        string model_dir = po.GetArg(1),
+            bundle_wxfilename = po.GetArg(2);
+
+        // Sorted for reproducible bundles
+        vector<pair<string, uint64> > files;
+        for (const auto &entry : fs::recursive_directory_iterator(model_dir)) {
+            if (!entry.is_regular_file())
+                continue;
+            files.push_back(make_pair(fs::relative(entry.path(), model_dir).generic_string(),
+                                      static_cast<uint64>(entry.file_size())));
+        }
+        sort(files.begin(), files.end());
+
+        uint64 header_size = sizeof(kBundleMagic) - 1 + 2 * sizeof(uint32);
+        for (const auto &file : files)
+            header_size += sizeof(uint32) + file.first.size() + 2 * sizeof(uint64);
+
+        vector<uint64> offsets;
+        uint64 offset = header_size;
+        for (const auto &file : files) {
+            offset = AlignOffset(offset);
+            offsets.push_back(offset);
+            offset += file.second;
+        }
+
+        std::ofstream os(bundle_wxfilename, std::ios_base::out | std::ios_base::binary);
+        if (!os) {
+            KALDI_ERR << "Could not open " << bundle_wxfilename << " for writing";
+        }
+
+        uint32 version = kBundleVersion, num_entries = files.size();
+        os.write(kBundleMagic, sizeof(kBundleMagic) - 1);
+        os.write(reinterpret_cast<const char *>(&version), sizeof(version));
+        os.write(reinterpret_cast<const char *>(&num_entries), sizeof(num_entries));
+        for (size_t i = 0; i < files.size(); i++) {
+            uint32 name_len = files[i].first.size();
+            os.write(reinterpret_cast<const char *>(&name_len), sizeof(name_len));
+            os.write(files[i].first.data(), name_len);
+            os.write(reinterpret_cast<const char *>(&offsets[i]), sizeof(uint64));
+            os.write(reinterpret_cast<const char *>(&files[i].second), sizeof(uint64));
+        }
+
+        for (size_t i = 0; i < files.size(); i++) {
+            uint64 pos = os.tellp();
+            KALDI_ASSERT(pos <= offsets[i]);
+            string padding(offsets[i] - pos, '\0');
+            os.write(padding.data(), padding.size());
+
+            // Copying an empty stream sets failbit, so empty files are skipped
+            std::ifstream is(fs::path(model_dir) / files[i].first, std::ios_base::in | std::ios_base::binary);
+            if (!is || (files[i].second > 0 && !(os << is.rdbuf()))) {
+                KALDI_ERR << "Could not copy " << files[i].first << " into bundle";
+            }
+            if (static_cast<uint64>(os.tellp()) != offsets[i] + files[i].second) {
+                KALDI_ERR << "File " << files[i].first << " changed while packing";
+            }
+        }
+
+        if (!os.flush()) {
+            KALDI_ERR << "Could not write bundle " << bundle_wxfilename;
+        }
+
+        KALDI_LOG << "Packed " << files.size() << " files into " << bundle_wxfilename;
+        return 0;
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return -1;
+    }
+}